@@ -9,526 +9,4551 @@ MIT License */
 #undef BUZZER_USE_SD
 #endif
 #endif
+#if !defined(BUZZER_NOUSE_SLEEP) && defined(ARDUINO_ARCH_AVR)
+#include <avr/sleep.h>
+#endif
+#ifdef ARDUINO_ARCH_RP2040
+#include <hardware/sync.h>
+#endif
 
 #define BUZ_LOG_PREFIX ANSI_GRAY "[Buzzer] " ANSI_DEFAULT
 
-namespace AsyncBuzzer
-{
-    static Config config;
-    static Pulse pulseState;
-    static Pattern patternState;
-    static Melody melodyState;
+// Binary files are loaded by copying records straight into Tone arrays
+static_assert(sizeof(AsyncBuzzer::Tone) == BUZ_FILE_TONE_SIZE, "Tone layout does not match the binary file record");
+static_assert(sizeof(AsyncBuzzer::FileHeader) == 6, "FileHeader must be packed");
+static_assert((BUZZER_STREAM_TONES & (BUZZER_STREAM_TONES - 1)) == 0, "BUZZER_STREAM_TONES must be a power of two");
 
-    bool setup(Config conf, uint8_t flags)
-    {
-        if (conf.pin == 255 && config.pin != 255)
-        {
-            noTone(config.pin);
-            pinMode(config.pin, INPUT);
-            config = Config();
-            pulseState = Pulse();
-            patternState = Pattern();
-            melodyState = Melody();
-            return false;
-        }
-        if (conf.pin == config.pin && !(flags & BUZ_FORCE))
-        {
-#ifndef BUZZER_SERIAL_DISABLE
-            if (!(flags & BUZ_SILENT))
-                SERIAL.println(F(BUZ_LOG_PREFIX "Buzzer pin already initialized." ANSI_DEFAULT));
+static_assert((BUZZER_MAILBOX_SIZE & (BUZZER_MAILBOX_SIZE - 1)) == 0, "BUZZER_MAILBOX_SIZE must be a power of two");
+
+#ifdef BUZZER_USE_TIMER
+#if !defined(ARDUINO_ARCH_AVR) && !defined(ARDUINO_ARCH_SAMD)
+#error "BUZZER_USE_TIMER is only supported on AVR and SAMD boards"
 #endif
-            return true;
-        }
+#endif
+#ifdef BUZZER_USE_TASK
+#if !defined(ARDUINO_ARCH_ESP32) && !defined(ARDUINO_ARCH_RP2040)
+#error "BUZZER_USE_TASK is only supported on ESP32 and RP2040 boards"
+#endif
+#ifdef BUZZER_USE_TIMER
+#error "BUZZER_USE_TASK and BUZZER_USE_TIMER both take the sequencer out of update(), define only one"
+#endif
+#ifdef ARDUINO_ARCH_RP2040
+#include <pico/time.h>
+#endif
+static_assert(BUZZER_MAILBOX_SIZE <= 64, "BUZZER_MAILBOX_SIZE must be at most 64 with BUZZER_USE_TASK");
+#endif
+#ifndef BUZZER_USE_SD
+#undef BUZZER_USE_TONE_TABLE // The table only holds sounds loaded into the arena
+#endif
+#ifdef BUZZER_USE_TONE_TABLE
+static_assert(BUZZER_TABLE_FREQUENCIES <= 255 && BUZZER_TABLE_TIMES <= 255, "Tone table indices are one byte");
+#endif
+#ifdef BUZZER_USE_PWM
+#if !defined(ARDUINO_ARCH_AVR) && !defined(ARDUINO_ARCH_SAMD)
+#error "BUZZER_USE_PWM is only supported on AVR and SAMD boards"
+#endif
+#if defined(ARDUINO_ARCH_AVR) && defined(BUZZER_USE_TIMER) && BUZZER_TIMER_AVR == BUZZER_PWM_AVR
+#error "BUZZER_USE_PWM and BUZZER_USE_TIMER cannot share an AVR timer, change BUZZER_TIMER_AVR or BUZZER_PWM_AVR"
+#endif
+#ifdef ARDUINO_ARCH_SAMD
+#include <wiring_private.h>
+#endif
+#endif
+#ifdef BUZZER_USE_SYNTH
+#if !defined(ARDUINO_ARCH_AVR)
+#error "BUZZER_USE_SYNTH is only supported on AVR boards"
+#endif
+#if (defined(BUZZER_USE_PWM) && BUZZER_PWM_AVR == 1) || (defined(BUZZER_USE_TIMER) && BUZZER_TIMER_AVR == 1)
+#error "BUZZER_USE_SYNTH needs Timer1, use BUZZER_PWM_AVR 2 or BUZZER_TIMER_AVR 2"
+#endif
+static_assert(BUZZER_SYNTH_VOICES >= 1 && BUZZER_SYNTH_VOICES <= 4, "BUZZER_SYNTH_VOICES must be 1 to 4");
+#endif
+#ifdef BUZZER_USE_STATS
+#if defined(DWT) && defined(CoreDebug_DEMCR_TRCENA_Msk) && defined(DWT_CTRL_CYCCNTENA_Msk)
+#define BUZ_STATS_CYCLES
+#define BUZ_COST_CLOCK() (DWT->CYCCNT)
+#else
+#define BUZ_COST_CLOCK() micros()
+#endif
+#endif
+#define BUZ_BARRIER() __asm__ __volatile__("" ::: "memory") // Forces state shared with an ISR to be re-read
 
-        config = Config(conf.pin);
-        pinMode(conf.pin, OUTPUT);
-        digitalWrite(conf.pin, LOW);
-#ifndef BUZZER_SERIAL_DISABLE
-        if (!(flags & BUZ_SILENT))
-            printConfig();
+#ifdef BUZZER_TIMEBASE_US
+#define BUZ_CLOCK() micros()
+#define BUZ_TICKS(units) ((uint32_t)(units) * BUZZER_TIMEBASE_US)   // Tone/Pulse time units to clock ticks
+#define BUZ_TONE(pin, frequency, duration) toneOn(pin, frequency, 0) // Ended explicitly with toneOff()
+#else
+#define BUZ_CLOCK() millis()
+#define BUZ_TICKS(units) ((uint32_t)(units))
+#define BUZ_TONE(pin, frequency, duration) toneOn(pin, frequency, duration)
 #endif
-        if (flags & BUZ_BEEP)
-            pulseBlocking(3);
-        return true;
-    }
 
-    bool setup(uint8_t pin, uint8_t flags)
+namespace AsyncBuzzer
+{
+    // Disables interrupts for its scope and restores the previous interrupt state
+    class IrqLock
     {
-        return setup(Config(pin), flags);
-    }
+#if defined(ARDUINO_ARCH_AVR)
+        uint8_t sreg;
 
-    bool advancePattern()
-    {
-        if (!patternState.active || patternState.pulses == nullptr || patternState.count == 0)
-        {
-            patternState.active = false;
-            return false;
-        }
-        patternState.current++;
-        if (patternState.current >= patternState.count)
+    public:
+        IrqLock() : sreg(SREG) { cli(); }
+        ~IrqLock() { SREG = sreg; }
+#elif defined(ARDUINO_ARCH_RP2040)
+        // Hardware spinlock: masking interrupts alone does not keep the other core out. Nests on the core holding it
+        static spin_lock_t *spin;
+        static volatile int8_t owner; // Core holding the lock, -1 while free
+        static uint8_t depth;
+        uint32_t saved;
+
+    public:
+        IrqLock() : saved(0)
         {
-            if (patternState.repeat)
-                patternState.current = 0;
+            if (owner == (int8_t)get_core_num())
+                depth++; // Interrupts are off on this core already
             else
             {
-                patternState.active = false;
-                return false;
+                saved = spin_lock_blocking(spin);
+                owner = (int8_t)get_core_num();
+                depth = 1;
             }
         }
-        Pulse nextPulse = patternState.pulses[patternState.current];
-        pulseState = Pulse(nextPulse.pulses, nextPulse.frequency, nextPulse.duration, nextPulse.interval, 0, true);
-        return true;
-    }
-
-    bool update()
-    {
-        if (pulseState.active && config.pin != 255)
+        ~IrqLock()
         {
-            uint32_t now = millis();
-            if (pulseState.pulses > 0)
-            {
-                if (pulseState.last == 0 || (now - pulseState.last) >= pulseState.interval + pulseState.duration)
-                {
-                    tone(config.pin, pulseState.frequency, pulseState.duration);
-                    pulseState.last = now;
-                    pulseState.pulses--;
-                }
-            }
-            else
+            if (--depth == 0)
             {
-                pulseState.active = false;
-                if (patternState.active)
-                {
-                    patternState.lastPulseEnd = millis() + pulseState.duration;
-                    patternState.waitingForDelay = true;
-                }
+                owner = -1;
+                spin_unlock(spin, saved);
             }
-            return pulseState.last == now;
         }
+#elif defined(__arm__)
+        uint32_t primask;
 
-        if (patternState.active && patternState.waitingForDelay)
+    public:
+        IrqLock() : primask(__get_PRIMASK()) { __disable_irq(); }
+        ~IrqLock() { __set_PRIMASK(primask); }
+#elif defined(ARDUINO_ARCH_ESP32)
+        static portMUX_TYPE mux; // Spinlock critical section: nests, restores the interrupt level and keeps the other core out
+
+    public:
+        IrqLock() { portENTER_CRITICAL_SAFE(&mux); }
+        ~IrqLock() { portEXIT_CRITICAL_SAFE(&mux); }
+#else
+        static uint8_t depth; // The previous state cannot be read, so only the outermost lock enables interrupts again
+
+    public:
+        IrqLock()
         {
-            uint32_t now = millis();
-            if (now >= patternState.lastPulseEnd)
-            {
-                uint32_t elapsed = now - patternState.lastPulseEnd;
-                if (elapsed >= patternState.pulseDelay)
-                {
-                    patternState.waitingForDelay = false;
-                    advancePattern();
-                }
-            }
+            noInterrupts();
+            depth++;
         }
-        else if (patternState.active && !pulseState.active && !patternState.waitingForDelay)
-            advancePattern();
-
-        if (melodyState.active && config.pin != 255 && !pulseState.active && !patternState.active)
+        ~IrqLock()
         {
-            uint32_t now = millis();
-            if (melodyState.current < melodyState.count)
-            {
-                Tone &currentTone = melodyState.tones[melodyState.current];
-                if (melodyState.toneStart == 0)
-                {
-                    melodyState.toneStart = now;
-                    melodyState.playingTone = true;
-                    if (currentTone.frequency > 0)
-                        tone(config.pin, currentTone.frequency, currentTone.duration);
-                }
-                else if (melodyState.playingTone)
-                {
-                    if (now - melodyState.toneStart >= currentTone.duration)
-                    {
-                        melodyState.playingTone = false;
-                        noTone(config.pin);
-                    }
-                }
-                else
-                {
-                    if (now - melodyState.toneStart >= currentTone.duration + currentTone.rest)
-                    {
-                        melodyState.current++;
-                        melodyState.toneStart = 0;
-                    }
-                }
-            }
-            else
-            {
-                if (melodyState.repeat)
-                {
-                    melodyState.current = 0;
-                    melodyState.toneStart = 0;
-                    melodyState.playingTone = false;
-                }
-                else
-                    melodyState.active = false;
-            }
+            if (--depth == 0)
+                interrupts();
         }
+#endif
+    };
+#if defined(ARDUINO_ARCH_ESP32)
+    portMUX_TYPE IrqLock::mux = portMUX_INITIALIZER_UNLOCKED;
+#elif defined(ARDUINO_ARCH_RP2040)
+    spin_lock_t *IrqLock::spin = spin_lock_init(spin_lock_claim_unused(true)); // Claimed before setup() and before core 1 starts
+    volatile int8_t IrqLock::owner = -1;
+    uint8_t IrqLock::depth = 0;
+#elif !defined(ARDUINO_ARCH_AVR) && !defined(__arm__)
+    uint8_t IrqLock::depth = 0;
+#endif
 
-        return false;
-    }
+    // Keeps the timer ISR out while the main loop changes engine state, compiles away without BUZZER_USE_TIMER
+#ifdef BUZZER_USE_TIMER
+    typedef IrqLock Lock;
+#else
+    class Lock
+    {
+    public:
+        Lock() {}
+        ~Lock() {}
+    };
+#endif
+
+    static Buzzer primary; // Channel behind the namespace-level API
 
-    Config getConfig()
+    uint16_t invalidNoteName()
     {
-        return config;
+        return 0;
     }
 
-    Config setConfig(Config conf, uint8_t flags)
+    uint8_t invalidPackedOp()
     {
-#ifndef BUZZER_SERIAL_DISABLE
-        if (!(flags & BUZ_SILENT))
-            printConfig();
-#endif
-        return (config = conf);
+        return BUZ_PK_END;
     }
 
-    void printConfig(const String &message)
+    // Frequencies of all key numbers from C0 to B8, indexed by packed melodies
+#define BUZ_OCTAVE_KEYS(o) Notes::key(o * 12), Notes::key(o * 12 + 1), Notes::key(o * 12 + 2), Notes::key(o * 12 + 3),    \
+                           Notes::key(o * 12 + 4), Notes::key(o * 12 + 5), Notes::key(o * 12 + 6), Notes::key(o * 12 + 7), \
+                           Notes::key(o * 12 + 8), Notes::key(o * 12 + 9), Notes::key(o * 12 + 10), Notes::key(o * 12 + 11)
+    static const uint16_t keyFrequencies[9 * 12] PROGMEM = {
+        BUZ_OCTAVE_KEYS(0), BUZ_OCTAVE_KEYS(1), BUZ_OCTAVE_KEYS(2), BUZ_OCTAVE_KEYS(3), BUZ_OCTAVE_KEYS(4),
+        BUZ_OCTAVE_KEYS(5), BUZ_OCTAVE_KEYS(6), BUZ_OCTAVE_KEYS(7), BUZ_OCTAVE_KEYS(8)};
+#undef BUZ_OCTAVE_KEYS
+
+    static inline uint16_t keyFrequency(uint8_t key)
     {
-#ifndef BUZZER_SERIAL_DISABLE
-        SERIAL.print(F(BUZ_LOG_PREFIX));
-        if (message.length())
-        {
-            SERIAL.print(message);
-            SERIAL.print(F(" "));
-        }
-        SERIAL.print(F("Pin: " ANSI_YELLOW));
-        SERIAL.print(config.pin);
-        SERIAL.print(F(ANSI_DEFAULT "  Ack: " ANSI_YELLOW));
-        SERIAL.print(config.ack.frequency);
-        SERIAL.print(F(ANSI_DEFAULT "Hz/" ANSI_YELLOW));
-        SERIAL.print(config.ack.duration);
-        SERIAL.print(F(ANSI_DEFAULT "ms/" ANSI_YELLOW));
-        SERIAL.print(config.ack.rest);
-        SERIAL.print(F(ANSI_DEFAULT "ms  Err: " ANSI_YELLOW));
-        SERIAL.print(config.err.frequency);
-        SERIAL.print(F(ANSI_DEFAULT "Hz/" ANSI_YELLOW));
-        SERIAL.print(config.err.duration);
-        SERIAL.print(F(ANSI_DEFAULT "ms/" ANSI_YELLOW));
-        SERIAL.print(config.err.rest);
-        SERIAL.println(F(ANSI_DEFAULT "ms" ANSI_DEFAULT));
-#endif
+        return key < 9 * 12 ? pgm_read_word(&keyFrequencies[key]) : 0;
     }
 
-    void beep(uint16_t frequency, uint16_t duration)
+    // 2^(i/64) scaled by 32768, for exponential sweeps without floating point
+    static const uint16_t octaveSteps[64] PROGMEM = {
+        32768, 33125, 33486, 33850, 34219, 34591, 34968, 35349, 35734, 36123, 36516, 36914, 37316, 37722, 38133, 38548,
+        38968, 39392, 39821, 40255, 40693, 41136, 41584, 42037, 42495, 42958, 43425, 43898, 44376, 44859, 45348, 45842,
+        46341, 46846, 47356, 47871, 48393, 48920, 49452, 49991, 50535, 51085, 51642, 52204, 52773, 53347, 53928, 54515,
+        55109, 55709, 56316, 56929, 57549, 58176, 58809, 59449, 60097, 60751, 61413, 62081, 62757, 63441, 64132, 64830};
+
+    // Frequency pitch 1/4096 octaves above (or below) base, interpolated from octaveSteps
+    static uint16_t pitchFrequency(uint16_t base, int32_t pitch)
     {
-        if (config.pin == 255)
-            return;
-        tone(config.pin, frequency, duration);
+        int8_t octave = (int8_t)(pitch >> 12);
+        uint8_t index = (pitch >> 6) & 0x3F;
+        uint32_t low = pgm_read_word(&octaveSteps[index]);
+        uint32_t high = index == 63 ? 65536UL : pgm_read_word(&octaveSteps[index + 1]);
+        uint32_t f = ((uint32_t)base * (low + (((high - low) * (pitch & 0x3F)) >> 6))) >> 15;
+        for (; octave > 0 && f <= 0xFFFF; octave--)
+            f <<= 1;
+        if (octave < 0)
+            f = octave < -16 ? 0 : f >> -octave;
+        return f > 0xFFFF ? 0xFFFF : (uint16_t)f;
     }
 
-    void pulse(uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval)
+    // Pitch of to above from in 1/4096 octaves, found by bisecting pitchFrequency()
+    static int32_t pitchSpan(uint16_t from, uint16_t to)
     {
-        if (config.pin == 255 || count == 0)
-            return;
-        pulseState = Pulse(count, frequency, duration, interval, 0, true);
+        int32_t low = -16L * 4096, high = 16L * 4096;
+        while (high - low > 1)
+        {
+            int32_t mid = low + (high - low) / 2;
+            if (pitchFrequency(from, mid) <= to)
+                low = mid;
+            else
+                high = mid;
+        }
+        return low;
     }
 
-    void pulseBlocking(uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval)
+    // Engine clock in BUZ_CLOCK() ticks, never 0 since 0 marks a pulse or tone that has not started
+    static inline uint32_t clockNow()
     {
-        pulse(count, frequency, duration, interval);
-        while (pulseState.pulses)
-            update();
+        uint32_t now = BUZ_CLOCK();
+        return now ? now : 1;
     }
 
-    void pattern(Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay)
+    // Engines of a channel that need step(), kept in Buzzer::running
+#define BUZ_RUN_QUEUE 0x01    // Queued or posted sound
+#define BUZ_RUN_PULSE 0x02    // Pulse group
+#define BUZ_RUN_PATTERN 0x04  // Pattern
+#define BUZ_RUN_MELODY 0x08   // Melody, packed melody or file stream
+#define BUZ_RUN_PROGRAM 0x10  // Sound program
+#define BUZ_RUN_SWEEP 0x20    // Frequency sweep
+#define BUZ_RUN_SOUNDING 0x40 // Pulse tone waiting for its noTone() with BUZZER_TIMEBASE_US
+
+    // Cleared by the sequencer once every channel is idle and no timed tone is left, so an idle update() returns at once
+    static volatile bool work = false;
+
+#ifdef BUZZER_USE_STATS
+    static Stats stats;
+
+    static void statsBegin()
     {
-        if (config.pin == 255 || pulses == nullptr || count == 0)
-            return;
-        patternState.active = false;
-        pulseState.active = false;
-        patternState = Pattern(pulses, count, 0, true, repeat, pulseDelay);
-        Pulse firstPulse = patternState.pulses[0];
-        pulseState = Pulse(firstPulse.pulses, firstPulse.frequency, firstPulse.duration, firstPulse.interval, 0, true);
+#ifdef BUZ_STATS_CYCLES
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        stats.cycles = true;
+#endif
     }
 
-    void patternBlocking(Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay)
+    static void statsUpdate(uint32_t cost)
     {
-        pattern(pulses, count, repeat, pulseDelay);
-        while (patternState.active || pulseState.active)
-            update();
+        if (stats.updates == 0)
+            statsBegin();
+        stats.updates++;
+        stats.totalCost += cost;
+        if (cost < stats.minCost)
+            stats.minCost = cost;
+        if (cost > stats.maxCost)
+            stats.maxCost = cost;
     }
 
-    bool isPatternActive()
+    // Records a sequenced tone start against the clock time it was due
+    static void statsTone(uint32_t due, uint32_t now)
     {
-        return patternState.active;
+        uint32_t late = (int32_t)(now - due) > 0 ? now - due : 0;
+        uint8_t bucket = 0;
+        for (uint32_t i = late / BUZ_TICKS(1); i && bucket < BUZZER_STATS_BUCKETS - 1; i >>= 1) // Buckets in Tone time units
+            bucket++;
+        stats.tones++;
+        stats.lastDue = due;
+        stats.lastStart = now;
+        if (late > stats.maxLatency)
+            stats.maxLatency = late;
+        if (stats.latency[bucket] != 0xFFFF)
+            stats.latency[bucket]++;
     }
+#endif
 
-    void stopPattern()
+#ifdef BUZZER_USE_PWM
+    // Pin driven straight from a timer waveform output instead of tone()
+    struct PwmOutput
     {
-        patternState.active = false;
-        pulseState.active = false;
-    }
+        uint8_t pin;              // Buzzer pin on the timer output, 255 if none
+        uint16_t frequency;       // Frequency the cached timer settings are for
+        PwmSetting setting;       // Cached timer settings for frequency
+        bool sounding;            // Waveform is on the pin
+        volatile bool timed;      // Output is switched off at offAt
+        volatile uint32_t offAt;  // Clock time a timed tone ends
+        uint32_t top;             // TOP loaded into the timer
+        uint8_t volume;           // setVolume() level
+        uint8_t amplitude;        // Envelope level of the current note
+        uint8_t duty;             // Compare value in 1/256 of the period, 128 is a square wave
+        uint8_t stage;            // Envelope step applied next, BUZZER_ENVELOPE_STEPS once sustaining
+        uint32_t stageAt;         // Clock time of the next envelope step
+    };
+    static PwmOutput pwm = {255, 0, PwmSetting(), false, false, 0, 0, 255, 255, 128, BUZZER_ENVELOPE_STEPS, 0};
 
-    void melody(Tone *tones, uint8_t count, bool repeat)
+    // Attack and decay levels set up by setEnvelope(), so each envelope step is a table read
+    struct Envelope
     {
-        if (config.pin == 255 || tones == nullptr || count == 0)
-            return;
-        stopMelody();
-        melodyState.tones = tones;
-        melodyState.count = count;
-        melodyState.current = 0;
-        melodyState.active = true;
-        melodyState.repeat = repeat;
-        melodyState.toneStart = 0;
-        melodyState.playingTone = false;
-    }
+        uint8_t levels[BUZZER_ENVELOPE_STEPS]; // Amplitude at each step, 255 is full volume
+        uint32_t stepTicks;                    // Clock ticks between steps, 0 without an envelope
+    };
+    static Envelope envelope;
 
-    void melodyBlocking(Tone *tones, uint8_t count, bool repeat)
+    static bool pwmAttach(uint8_t pin);
+    static void pwmStart(uint16_t frequency);
+    static void pwmStop();
+    static void pwmWriteDuty();
+
+    // Duty in 1/256 of the period giving a fundamental of amplitude i/16, from sin(pi * duty) = amplitude
+    static const uint8_t amplitudeDuty[17] PROGMEM = {0, 5, 10, 15, 21, 26, 31, 37, 43, 49, 55, 62, 69, 77, 87, 99, 128};
+
+    // Sets the duty for the envelope amplitude scaled by the volume
+    static void pwmLevel(uint8_t amplitude)
     {
-        melody(tones, count, repeat);
-        melodyState.repeat = false;
-        while (melodyState.active)
-        {
-            update();
-            delay(1);
-        }
+        pwm.amplitude = amplitude;
+        uint16_t level = ((uint16_t)amplitude * (pwm.volume + 1)) >> 8;
+        level += level >> 7; // 0 to 256
+        uint8_t low = pgm_read_byte(&amplitudeDuty[level >> 4]);
+        uint8_t high = level >= 256 ? low : pgm_read_byte(&amplitudeDuty[(level >> 4) + 1]);
+        pwm.duty = low + (((high - low) * (level & 0x0F)) >> 4);
     }
 
-    bool isMelodyActive()
+    // Fills the settings cache so the next pwmStart(frequency) does no math
+    static inline void pwmPreset(uint16_t frequency, const PwmSetting &setting)
     {
-        return melodyState.active;
+        pwm.frequency = frequency;
+        pwm.setting = setting;
     }
 
-    void stopMelody()
+    static inline const PwmSetting &pwmSetting(uint16_t frequency)
     {
-        melodyState.active = false;
-        if (config.pin != 255)
-            noTone(config.pin);
+        if (frequency != pwm.frequency)
+            pwmPreset(frequency, Pwm::setting(frequency));
+        return pwm.setting;
     }
+#endif
 
-#ifdef BUZZER_USE_SD
-    static uint8_t split(char *input, char **output, uint8_t max_elements)
+#ifdef BUZZER_USE_SYNTH
+    // Square wave voices mixed into the Timer1 PWM compare value at BUZZER_SYNTH_HZ
+    struct Synth
     {
-        for (uint8_t i = 0; i < max_elements; ++i)
-            output[i] = nullptr;
-        uint8_t count = 0;
-        char *ptr = input;
-        while (*ptr && count < max_elements)
+        static volatile uint16_t phase[BUZZER_SYNTH_VOICES];     // Phase accumulators, bit 15 is the square wave
+        static volatile uint16_t increment[BUZZER_SYNTH_VOICES]; // Phase step per sample for the voice frequency
+        static volatile uint16_t level[BUZZER_SYNTH_VOICES];     // Compare counts added while a voice is high, 0 if silent
+        static bool timed[BUZZER_SYNTH_VOICES];                  // Voice is switched off at offAt
+        static uint32_t offAt[BUZZER_SYNTH_VOICES];              // Clock time a timed voice ends
+        static bool running;                                     // Timer1 is set up for the synth
+
+        static constexpr uint16_t top() { return F_CPU / BUZZER_SYNTH_HZ - 1; }
+
+        // Voice number of a BUZ_VOICE() pin, BUZZER_SYNTH_VOICES for a real pin
+        static inline uint8_t voice(uint8_t pin)
         {
-            // Skip leading spaces
-            while (*ptr == ' ')
-                ++ptr;
-            if (!*ptr)
-                break;
-            if (*ptr == '"')
-            {
-                // Quoted token
-                ++ptr; // Skip opening quote
-                output[count++] = ptr;
-                while (*ptr && *ptr != '"')
-                    ++ptr;
-                if (*ptr == '"')
-                {
-                    *ptr = '\0'; // Null-terminate token
-                    ++ptr;       // Move past closing quote
-                }
-            }
-            else
-            {
-                // Unquoted token
-                output[count++] = ptr;
-                while (*ptr && *ptr != ' ' && *ptr != '"')
-                    ++ptr;
-                if (*ptr)
-                {
-                    *ptr = '\0';
-                    ++ptr;
-                }
-            }
+            return pin >= BUZ_VOICE(0) && pin < BUZ_VOICE(BUZZER_SYNTH_VOICES) ? pin - BUZ_VOICE(0) : BUZZER_SYNTH_VOICES;
         }
-        return count;
-    }
-#endif
 
-    uint8_t loadPattern(const String &path, Pulse *pulses, uint8_t flags)
-    {
-#ifdef BUZZER_USE_SD
-        if (pulses == nullptr)
-            return 0;
-        static Pulse *staticPulses = nullptr;
-        static uint8_t staticPulseCount = 0;
-        staticPulses = pulses;
-        staticPulseCount = 0;
-        bool validFile = SDCard::processLines(path, flags, [](const String &line, uint16_t linenum, uint8_t flags) -> bool
-                                              {
-            String trimmedLine = line;
-            trimmedLine.trim();
-            if (linenum == 1) {
-                if (trimmedLine != F("# pattern")) {
-#ifndef BUZZER_SERIAL_DISABLE
-                    if (!(flags & BUZ_SILENT))
-                        SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid pattern file format!" ANSI_DEFAULT));
-#endif
-                    return false;
-                }
-                return true;
-            }
-            if (trimmedLine.length() == 0 || trimmedLine.startsWith(F("#")))
-                return true;
-            if (staticPulseCount >= BUZZER_MAX_PATTERN_PULSES)
+        static bool begin()
+        {
+            if (running)
                 return true;
+            if (digitalPinToTimer(BUZZER_SYNTH_PIN) != TIMER1A)
+                return false;
+            pinMode(BUZZER_SYNTH_PIN, OUTPUT);
+            IrqLock lock;
+            // Fast PWM with ICR1 as TOP, so the carrier runs at the sample rate
+            ICR1 = top();
+            OCR1A = 0;
+            TCNT1 = 0;
+            TCCR1A = _BV(COM1A1) | _BV(WGM11);
+            TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS10);
+            running = true;
+            return true;
+        }
+
+        static void start(uint8_t v, uint16_t frequency, uint16_t duration)
+        {
+            uint16_t step = (uint16_t)(((uint32_t)frequency << 16) / BUZZER_SYNTH_HZ); // The only division per note
+            IrqLock lock;
+            increment[v] = step;
+            level[v] = (top() + 1) / BUZZER_SYNTH_VOICES;
+#ifdef BUZZER_TIMEBASE_US
+            offAt[v] = clockNow() + (uint32_t)duration * 1000UL;
+#else
+            offAt[v] = clockNow() + duration;
+#endif
+            timed[v] = duration != 0;
+            work = true;
+            TIMSK1 |= _BV(TOIE1);
+        }
+
+        static void retune(uint8_t v, uint16_t frequency)
+        {
+            uint16_t step = (uint16_t)(((uint32_t)frequency << 16) / BUZZER_SYNTH_HZ);
+            IrqLock lock;
+            increment[v] = step;
+        }
+
+        static void stop(uint8_t v)
+        {
+            IrqLock lock;
+            level[v] = 0;
+            timed[v] = false;
+            for (uint8_t i = 0; i < BUZZER_SYNTH_VOICES; i++)
+                if (level[i])
+                    return;
+            TIMSK1 &= ~_BV(TOIE1); // All voices are silent, stop sampling
+            OCR1A = 0;
+        }
 
-            char buff[25];
-            char *tok[6];
-            trimmedLine.toCharArray(buff, sizeof(buff));
-            split(buff, tok, 4);
-            if (tok[0] != nullptr && tok[1] != nullptr && tok[2] != nullptr && tok[3] != nullptr)
+        // Runs in the Timer1 overflow interrupt, about 15 cycles per voice plus the interrupt overhead
+        static inline void sample()
+        {
+            uint16_t out = 0;
+            for (uint8_t i = 0; i < BUZZER_SYNTH_VOICES; i++)
             {
-                uint8_t pulseCnt = (uint8_t)atoi(tok[0]);
-                uint16_t freq = (uint16_t)atoi(tok[1]);
-                uint16_t dur = (uint16_t)atoi(tok[2]);
-                uint16_t interval = (uint16_t)atoi(tok[3]);
-                staticPulses[staticPulseCount] = Pulse(pulseCnt, freq, dur, interval, 0, false);
-                staticPulseCount++;
+                uint16_t p = phase[i] + increment[i];
+                phase[i] = p;
+                if (p & 0x8000)
+                    out += level[i];
             }
-            return true; });
+            OCR1A = out;
+        }
+    };
+    volatile uint16_t Synth::phase[BUZZER_SYNTH_VOICES];
+    volatile uint16_t Synth::increment[BUZZER_SYNTH_VOICES];
+    volatile uint16_t Synth::level[BUZZER_SYNTH_VOICES];
+    bool Synth::timed[BUZZER_SYNTH_VOICES];
+    uint32_t Synth::offAt[BUZZER_SYNTH_VOICES];
+    bool Synth::running = false;
+#endif
 
-        uint8_t pulseCount = staticPulseCount;
-        if (!validFile)
-            return 0;
-#ifndef BUZZER_SERIAL_DISABLE
-        if (!(flags & BUZ_SILENT))
+    // Starts a tone, duration in milliseconds with 0 playing until toneOff()
+    static void toneOn(uint8_t pin, uint16_t frequency, uint16_t duration)
+    {
+#ifdef BUZZER_USE_SYNTH
+        if (Synth::voice(pin) < BUZZER_SYNTH_VOICES)
         {
-            SERIAL.print(F(BUZ_LOG_PREFIX "Loaded "));
-            SERIAL.print(pulseCount);
-            SERIAL.print(F(" pulses from "));
-            SERIAL.println(path);
+            Synth::start(Synth::voice(pin), frequency, duration);
+            return;
         }
 #endif
-        return pulseCount;
+#ifdef BUZZER_USE_PWM
+        if (pin == pwm.pin)
+        {
+            IrqLock lock;
+            pwmLevel(envelope.stepTicks ? envelope.levels[0] : 255); // Every note starts its envelope over
+            pwm.stage = envelope.stepTicks ? 1 : BUZZER_ENVELOPE_STEPS;
+            pwm.stageAt = clockNow() + envelope.stepTicks;
+            pwmStart(frequency);
+#ifdef BUZZER_TIMEBASE_US
+            pwm.offAt = clockNow() + (uint32_t)duration * 1000UL;
 #else
-#ifndef BUZZER_SERIAL_DISABLE
-        if (!(flags & BUZ_SILENT))
-            SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "SD card support not enabled!" ANSI_DEFAULT));
+            pwm.offAt = clockNow() + duration;
 #endif
-        return 0;
+            pwm.timed = duration != 0;
+            work = true; // The sequencer ends the tone and steps its envelope
+            return;
+        }
+#endif
+        if (duration)
+            tone(pin, frequency, duration);
+        else
+            tone(pin, frequency);
+    }
+
+    // Changes the frequency of a sounding tone, keeping its envelope and end time
+    static void toneRetune(uint8_t pin, uint16_t frequency)
+    {
+#ifdef BUZZER_USE_SYNTH
+        if (Synth::voice(pin) < BUZZER_SYNTH_VOICES)
+        {
+            Synth::retune(Synth::voice(pin), frequency);
+            return;
+        }
+#endif
+#ifdef BUZZER_USE_PWM
+        if (pin == pwm.pin)
+        {
+            IrqLock lock;
+            pwmStart(frequency);
+            return;
+        }
+#endif
+        tone(pin, frequency);
+    }
+
+    static void toneOff(uint8_t pin)
+    {
+#ifdef BUZZER_USE_SYNTH
+        if (Synth::voice(pin) < BUZZER_SYNTH_VOICES)
+        {
+            Synth::stop(Synth::voice(pin));
+            return;
+        }
+#endif
+#ifdef BUZZER_USE_PWM
+        if (pin == pwm.pin)
+        {
+            IrqLock lock;
+            pwm.timed = false;
+            pwmStop();
+            return;
+        }
+#endif
+        noTone(pin);
+    }
+
+    // Ends a timed PWM tone and steps its envelope, the core tone() times its own duration
+    static inline void serviceTone(uint32_t now)
+    {
+#ifdef BUZZER_USE_SYNTH
+        for (uint8_t i = 0; i < BUZZER_SYNTH_VOICES; i++)
+            if (Synth::timed[i] && (int32_t)(now - Synth::offAt[i]) >= 0)
+                Synth::stop(i);
+#endif
+#ifdef BUZZER_USE_PWM
+        if (pwm.timed && (int32_t)(now - pwm.offAt) >= 0)
+        {
+            pwm.timed = false;
+            pwmStop();
+        }
+        if (pwm.sounding && pwm.stage < BUZZER_ENVELOPE_STEPS && (int32_t)(now - pwm.stageAt) >= 0)
+        {
+            pwm.stageAt += envelope.stepTicks;
+            pwmLevel(envelope.levels[pwm.stage++]);
+            pwmWriteDuty();
+        }
+#endif
+#if !defined(BUZZER_USE_SYNTH) && !defined(BUZZER_USE_PWM)
+        (void)now;
+#endif
+    }
+
+    // True while serviceTone() still has a tone to end or an envelope to step
+    static inline bool toneBusy()
+    {
+#ifdef BUZZER_USE_SYNTH
+        for (uint8_t i = 0; i < BUZZER_SYNTH_VOICES; i++)
+            if (Synth::timed[i])
+                return true;
+#endif
+#ifdef BUZZER_USE_PWM
+        if (pwm.timed || (pwm.sounding && pwm.stage < BUZZER_ENVELOPE_STEPS))
+            return true;
+#endif
+        return false;
+    }
+
+    // Mailbox commands posted from interrupt context, or from other tasks with BUZZER_USE_TASK:
+#define BUZ_CMD_BEEP 1
+#define BUZ_CMD_PULSE 2
+#define BUZ_CMD_STOP 3
+#define BUZ_CMD_PATTERN 4      // Starts the pattern in sound
+#define BUZ_CMD_MELODY 5       // Replaces the melody with the one in sound
+#define BUZ_CMD_STOP_PATTERN 6
+#define BUZ_CMD_STOP_MELODY 7
+#define BUZ_CMD_POST 8         // Posts sound to the queue
+#define BUZ_CMD_CLEAR 9        // Clears the queue
+
+    struct Command
+    {
+        Buzzer *target;     // Buzzer the command applies to
+        uint8_t op;         // BUZ_CMD_*
+        uint8_t count;      // Pulse count
+        uint16_t frequency; // Beep and pulse frequency
+        uint16_t duration;  // Beep and pulse duration
+        uint16_t interval;  // Pulse interval
+#ifdef BUZZER_USE_TASK
+        Sound sound;               // Pattern, melody or posted sound
+#ifdef ARDUINO_ARCH_ESP32
+        volatile uint8_t sequence; // Ring position the slot is free for, plus one once it is filled
+#endif
+#endif
+    };
+
+#ifdef BUZZER_USE_TASK
+    // Multi-producer ring for tasks on either core and ISRs, drained by the sequencer task
+    struct Mailbox
+    {
+        Command slots[BUZZER_MAILBOX_SIZE];
+        volatile uint8_t head;
+        volatile uint8_t tail;
+        volatile uint8_t done; // Commands the sequencer has finished running, counted after each one has run
+#ifdef ARDUINO_ARCH_ESP32
+        Mailbox() : head(0), tail(0), done(0)
+        {
+            for (uint8_t i = 0; i < BUZZER_MAILBOX_SIZE; i++)
+                slots[i].sequence = i;
+        }
+#else
+        Mailbox() : head(0), tail(0), done(0) {}
+#endif
+    };
+    static Mailbox mailbox;
+    static void taskWake();
+
+#ifdef ARDUINO_ARCH_RP2040
+    // Cortex-M0+ has no compare-and-swap and the cores do not reliably link libatomic, so the ring is taken under IrqLock
+    static bool pushCommand(const Command &in)
+    {
+        {
+            IrqLock lock;
+            uint8_t tail = mailbox.tail;
+            if ((uint8_t)(tail - mailbox.head) >= BUZZER_MAILBOX_SIZE)
+                return false;
+            mailbox.slots[tail % BUZZER_MAILBOX_SIZE] = in;
+            mailbox.tail = tail + 1;
+        }
+        taskWake();
+        return true;
+    }
+
+    static bool takeCommand(Command &out)
+    {
+        IrqLock lock;
+        uint8_t head = mailbox.head;
+        if (head == mailbox.tail)
+            return false;
+        out = mailbox.slots[head % BUZZER_MAILBOX_SIZE];
+        mailbox.head = head + 1;
+        return true;
+    }
+#else
+    // A producer claims tail with a compare-and-swap, and the sequence of each slot tells producers
+    // and the sequencer task whether it is free or filled
+    static bool pushCommand(const Command &in)
+    {
+        uint8_t pos = __atomic_load_n(&mailbox.tail, __ATOMIC_RELAXED);
+        Command *cmd;
+        while (true)
+        {
+            cmd = &mailbox.slots[pos % BUZZER_MAILBOX_SIZE];
+            int8_t lag = (int8_t)(__atomic_load_n(&cmd->sequence, __ATOMIC_ACQUIRE) - pos);
+            if (lag < 0)
+                return false; // Full: the slot still holds a command from the previous lap
+            if (lag == 0 && __atomic_compare_exchange_n(&mailbox.tail, &pos, (uint8_t)(pos + 1), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            if (lag > 0)
+                pos = __atomic_load_n(&mailbox.tail, __ATOMIC_RELAXED); // Another producer took it
+        }
+        cmd->target = in.target;
+        cmd->op = in.op;
+        cmd->count = in.count;
+        cmd->frequency = in.frequency;
+        cmd->duration = in.duration;
+        cmd->interval = in.interval;
+        cmd->sound = in.sound;
+        __atomic_store_n(&cmd->sequence, (uint8_t)(pos + 1), __ATOMIC_RELEASE);
+        taskWake();
+        return true;
+    }
+
+    static bool takeCommand(Command &out)
+    {
+        uint8_t head = mailbox.head;
+        Command &cmd = mailbox.slots[head % BUZZER_MAILBOX_SIZE];
+        if (__atomic_load_n(&cmd.sequence, __ATOMIC_ACQUIRE) != (uint8_t)(head + 1))
+            return false; // Empty, or the producer is still filling the slot
+        out.target = cmd.target;
+        out.op = cmd.op;
+        out.count = cmd.count;
+        out.frequency = cmd.frequency;
+        out.duration = cmd.duration;
+        out.interval = cmd.interval;
+        out.sound = cmd.sound;
+        __atomic_store_n(&cmd.sequence, (uint8_t)(head + BUZZER_MAILBOX_SIZE), __ATOMIC_RELEASE);
+        mailbox.head = head + 1;
+        return true;
+    }
+#endif
+#else
+    // Single-producer/single-consumer ring: ISRs only advance tail, update() only advances head
+    struct Mailbox
+    {
+        Command slots[BUZZER_MAILBOX_SIZE];
+        volatile uint8_t head;
+        volatile uint8_t tail;
+    };
+    static Mailbox mailbox;
+
+    static bool pushCommand(const Command &in)
+    {
+        uint8_t tail = mailbox.tail;
+        if ((uint8_t)(tail - mailbox.head) >= BUZZER_MAILBOX_SIZE)
+            return false;
+        mailbox.slots[tail % BUZZER_MAILBOX_SIZE] = in;
+        BUZ_BARRIER();
+        mailbox.tail = tail + 1;
+        return true;
+    }
+
+    static bool takeCommand(Command &out)
+    {
+        uint8_t head = mailbox.head;
+        if (head == mailbox.tail)
+            return false;
+        out = mailbox.slots[head % BUZZER_MAILBOX_SIZE];
+        BUZ_BARRIER();
+        mailbox.head = head + 1;
+        return true;
+    }
+#endif
+
+    static bool sendCommand(Buzzer *target, uint8_t op, uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval)
+    {
+        Command cmd;
+        cmd.target = target;
+        cmd.op = op;
+        cmd.count = count;
+        cmd.frequency = frequency;
+        cmd.duration = duration;
+        cmd.interval = interval;
+        return pushCommand(cmd);
+    }
+
+#ifdef BUZZER_USE_TASK
+    static bool sendSound(Buzzer *target, uint8_t op, const Sound &sound)
+    {
+        Command cmd;
+        cmd.target = target;
+        cmd.op = op;
+        cmd.count = 0;
+        cmd.frequency = 0;
+        cmd.duration = 0;
+        cmd.interval = 0;
+        cmd.sound = sound;
+        return pushCommand(cmd);
+    }
+
+#if defined(ARDUINO_ARCH_ESP32)
+    static TaskHandle_t task = nullptr;
+
+    // Engine state belongs to the sequencer task; before it exists, callers change it directly
+    static bool onSequencer()
+    {
+        return task == nullptr || (!xPortInIsrContext() && xTaskGetCurrentTaskHandle() == task);
+    }
+
+    static void taskWake()
+    {
+        if (task == nullptr)
+            return;
+        if (xPortInIsrContext())
+            vTaskNotifyGiveFromISR(task, nullptr);
+        else
+            xTaskNotifyGive(task);
+    }
+
+    static bool inInterrupt()
+    {
+        return xPortInIsrContext();
+    }
+#else
+    static volatile bool sequencerStarted = false; // Set by the first runTask() on the second core
+
+    // The sequencer runs in loop1() on the second core; until runTask() has run there, callers change the state directly
+    static bool onSequencer()
+    {
+        return !sequencerStarted || get_core_num() == 1;
+    }
+
+    static void taskWake()
+    {
+        __sev();
+    }
+
+    static bool inInterrupt()
+    {
+        return __get_current_exception() != 0;
+    }
+#endif
+
+#define BUZ_CMD_CALL 10 // Runs a call handed over by callOnTask()
+
+    // A call another task waits on until the sequencer has run it
+    struct TaskCall
+    {
+        void (*run)(void *fn);
+        void *fn;
+        volatile bool done;
+    };
+
+    static void idle();
+
+    // Returns false without running the call if the mailbox stays full for BUZZER_CALL_TIMEOUT
+    static bool runCall(void (*run)(void *fn), void *fn)
+    {
+        if (inInterrupt())
+            return false; // Cannot wait here, ISRs use the FromISR functions
+        TaskCall call;
+        call.run = run;
+        call.fn = fn;
+        call.done = false;
+        Command cmd;
+        cmd.target = nullptr;
+        cmd.op = BUZ_CMD_CALL;
+        cmd.count = 0;
+        cmd.frequency = 0;
+        cmd.duration = 0;
+        cmd.interval = 0;
+        cmd.sound = Sound(BUZ_SOUND_NONE, 0, BUZ_NONE, &call);
+        uint32_t began = millis();
+        while (!pushCommand(cmd))
+        {
+            if (millis() - began >= BUZZER_CALL_TIMEOUT)
+                return false; // The sequencer is not keeping up, the call fails with its default result
+            idle();
+        }
+        while (!__atomic_load_n(&call.done, __ATOMIC_ACQUIRE))
+            idle(); // The command points at call on this stack, so it cannot be abandoned once posted
+        return true;
+    }
+
+    // Runs call on the sequencer task and returns once it has run there, false if it could not be posted
+    template <typename F>
+    static bool callOnTask(F &call)
+    {
+        return runCall([](void *fn) { (*(F *)fn)(); }, &call);
+    }
+
+    // Engine state, the arena and the SD card belong to the sequencer task: a state-changing call
+    // made anywhere else is run there and its result returned; from an ISR, or if the mailbox stays full,
+    // it does nothing and returns the type's default (false, 0 or BUZ_NO_SOUND)
+#define BUZ_TASK_CALL(type, ...)                       \
+    if (!onSequencer())                                \
+    {                                                  \
+        type result = type();                          \
+        auto call = [&]() { result = __VA_ARGS__; };   \
+        callOnTask(call);                              \
+        return result;                                 \
+    }
+#define BUZ_TASK_CALL_VOID(...)                        \
+    if (!onSequencer())                                \
+    {                                                  \
+        auto call = [&]() { __VA_ARGS__; };            \
+        callOnTask(call);                              \
+        return;                                        \
+    }
+#else
+#define BUZ_TASK_CALL(type, ...)
+#define BUZ_TASK_CALL_VOID(...)
+#endif
+
+#ifdef BUZZER_USE_SD
+    // Assembles text lines from a file one chunk at a time, used by playFile() and the loaders
+    struct LineReader
+    {
+        uint8_t chunk[BUZZER_STREAM_CHUNK]; // Raw bytes read from the file
+        uint8_t chunkPos;                   // Next unparsed byte in chunk
+        uint8_t chunkLen;                   // Valid bytes in chunk
+        char line[24];                      // Line being assembled from chunk
+        uint8_t lineLen;                    // Characters in line
+        uint16_t linenum;                   // Number of the last line returned
+        bool overflow;                      // Characters were dropped from the line being assembled
+        bool truncated;                     // Last line returned was longer than line
+        bool ended;                         // File is exhausted
+        LineReader() : chunkPos(0), chunkLen(0), lineLen(0), linenum(0), overflow(false), truncated(false), ended(false) {}
+    };
+
+    // readLine() results:
+#define BUZ_LINE_READY 0 // A line is returned
+#define BUZ_LINE_END 1   // No more lines
+#define BUZ_LINE_WAIT 2  // The allowed chunk reads are used up
+
+    // Returns the next line with surrounding whitespace removed, reading at most reads more chunks
+    static uint8_t readLine(File &file, LineReader &r, uint8_t &reads, char *&line)
+    {
+        while (true)
+        {
+            if (r.chunkPos >= r.chunkLen)
+            {
+                if (r.ended)
+                    return BUZ_LINE_END;
+                if (reads == 0)
+                    return BUZ_LINE_WAIT;
+                reads--;
+                int len = file.read(r.chunk, sizeof(r.chunk));
+                if (len <= 0)
+                {
+                    r.ended = true;
+                    if (r.lineLen == 0)
+                        return BUZ_LINE_END;
+                    break; // Last line without a newline
+                }
+                r.chunkLen = (uint8_t)len;
+                r.chunkPos = 0;
+            }
+            char c = (char)r.chunk[r.chunkPos++];
+            if (c == '\n')
+                break;
+            if (r.lineLen < sizeof(r.line) - 1)
+                r.line[r.lineLen++] = c;
+            else
+                r.overflow = true;
+        }
+        r.line[r.lineLen] = '\0';
+        r.lineLen = 0;
+        r.truncated = r.overflow;
+        r.overflow = false;
+        r.linenum++;
+        line = r.line;
+        while (*line == ' ' || *line == '\t')
+            ++line;
+        char *end = line + strlen(line);
+        while (end > line && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+            *--end = '\0';
+        return BUZ_LINE_READY;
+    }
+
+    // readLine() for the loaders that read a whole file at once, returns false at the end of the file
+    static bool nextLine(File &file, LineReader &r, char *&line)
+    {
+        uint8_t result;
+        do
+        {
+            uint8_t reads = 1;
+            result = readLine(file, r, reads, line);
+        } while (result == BUZ_LINE_WAIT);
+        return result == BUZ_LINE_READY;
+    }
+
+    struct ToneStream
+    {
+        File file;                          // Open sound file
+        Tone ring[BUZZER_STREAM_TONES];     // Parsed tones waiting to be played
+        volatile uint8_t head;              // Free-running read index, advanced by the sequencer
+        volatile uint8_t tail;              // Free-running write index, advanced by refillStream()
+        LineReader reader;                  // Line assembly state for file
+        volatile bool eof;                  // No more tones to read
+        uint8_t flags;                      // Flags passed to playFile()
+        int8_t cacheSlot;                   // Cache entry the parsed tones are copied into, -1 if none
+        uint8_t cached;                     // Tones copied into the cache entry
+    };
+    static ToneStream streamState;
+
+    static void closeStream();
+    static bool refillStream();
+
+    // A file prefetch() reads into an arena entry a few records per update()
+    struct Prefetch
+    {
+        File file;
+        LineReader reader; // Line assembly state for text files
+        uint16_t left;     // Records a binary file still holds, 0 for text files
+        uint16_t budget;   // Microseconds per update()
+        int8_t slot;       // Arena entry being filled, -1 when no prefetch runs
+        uint8_t kind;      // BUZ_FILE_TONES or BUZ_FILE_PULSES once the header is read, 0 before
+        uint8_t count;     // Records decoded
+        uint8_t limit;     // Records the reserved room holds
+        uint8_t flags;     // Flags passed to prefetch()
+        bool binary;       // The file started with a binary header
+        bool sniffed;      // The first bytes were checked for a binary header
+        Prefetch() : left(0), budget(0), slot(-1), kind(0), count(0), limit(0), flags(0), binary(false), sniffed(false) {}
+    };
+    static Prefetch fetch;
+    static void servicePrefetch(uint16_t budget);
+
+    static uint8_t streamCount()
+    {
+        return (uint8_t)(streamState.tail - streamState.head);
+    }
+#endif
+
+#ifdef BUZZER_USE_TONE_TABLE
+    // Arena records hold one-byte indices into tables of the distinct values all loaded sounds share
+    struct TableTone
+    {
+        uint8_t frequency; // Index into ToneTable::frequencies
+        uint8_t duration;  // Index into ToneTable::times
+        uint8_t rest;      // Index into ToneTable::times
+    };
+
+    struct TablePulse
+    {
+        uint8_t pulses;
+        uint8_t frequency; // Index into ToneTable::frequencies
+        uint8_t duration;  // Index into ToneTable::times
+        uint8_t interval;  // Index into ToneTable::times
+    };
+
+    // Filled as sounds are loaded, an entry is free again once no loaded record refers to it
+    struct ToneTable
+    {
+        uint16_t frequencies[BUZZER_TABLE_FREQUENCIES];
+        uint16_t times[BUZZER_TABLE_TIMES]; // Durations, rests and intervals
+        uint16_t frequencyRefs[BUZZER_TABLE_FREQUENCIES]; // Record fields using each entry, 0 if it is free
+        uint16_t timeRefs[BUZZER_TABLE_TIMES];
+#ifdef BUZZER_USE_PWM
+        PwmSetting settings[BUZZER_TABLE_FREQUENCIES]; // Timer setting of each frequency, worked out when it is added
+#endif
+        uint8_t frequencyCount; // Entries ever used since setArena(), free ones among them are reused first
+        uint8_t timeCount;
+    };
+    static ToneTable table;
+#endif
+
+#ifdef BUZZER_USE_TIMER
+    static void startTimer();
+    static void stopTimer();
+#endif
+#if defined(BUZZER_USE_TASK) && defined(ARDUINO_ARCH_ESP32)
+    static void startTask();
+#endif
+
+    // Table of initialized channels, serviced together by update() or the timer ISR
+    struct Channels
+    {
+        static Buzzer *table[BUZZER_MAX_CHANNELS];
+        static uint8_t count;
+#ifdef BUZZER_USE_SD
+        static Buzzer *streamOwner; // Channel playing the open file
+#endif
+
+        static bool attach(Buzzer *buzzer)
+        {
+            for (uint8_t i = 0; i < count; i++)
+                if (table[i] == buzzer)
+                    return true;
+            if (count >= BUZZER_MAX_CHANNELS)
+                return false;
+            {
+                Lock lock;
+                table[count++] = buzzer;
+            }
+#ifdef BUZZER_USE_TIMER
+            if (count == 1)
+                startTimer();
+#endif
+#if defined(BUZZER_USE_TASK) && defined(ARDUINO_ARCH_ESP32)
+            if (task == nullptr)
+                startTask();
+#endif
+            return true;
+        }
+
+        static void detach(Buzzer *buzzer)
+        {
+            Lock lock;
+            for (uint8_t i = 0; i < count; i++)
+            {
+                if (table[i] != buzzer)
+                    continue;
+                table[i] = table[--count];
+#ifdef BUZZER_USE_TIMER
+                if (count == 0)
+                    stopTimer();
+#endif
+                return;
+            }
+        }
+
+#ifdef BUZZER_USE_SD
+        // File access stays in the main loop, even when the sequencer runs from the timer ISR
+        static void serviceStream()
+        {
+            Buzzer *owner = streamOwner;
+            if (owner == nullptr)
+                return;
+            if (owner->melodyState.active && owner->melodyState.source == BUZ_SRC_STREAM)
+                refillStream();
+            else
+            {
+                closeStream();
+                streamOwner = nullptr;
+#ifndef BUZZER_SERIAL_DISABLE
+                if (!(streamState.flags & BUZ_SILENT))
+                    SERIAL.println(F(BUZ_LOG_PREFIX "Play finished."));
+#endif
+            }
+        }
+#endif
+
+        static bool nextDeadline(uint32_t &deadline);
+
+        // True if a channel is playing a melody or pattern stored in [begin, end)
+        static bool uses(const uint8_t *begin, const uint8_t *end)
+        {
+            for (uint8_t i = 0; i < count; i++)
+            {
+                const Buzzer *b = table[i];
+                const uint8_t *tones = (const uint8_t *)b->melodyState.tones;
+                const uint8_t *pulses = (const uint8_t *)b->patternState.pulses;
+                if ((b->melodyState.active && tones >= begin && tones < end) || (b->patternState.active && pulses >= begin && pulses < end))
+                    return true;
+            }
+            return false;
+        }
+
+        // Stops the melodies and patterns stored in [begin, end) and drops the queued and chained sounds
+        // stored there, before that memory is handed out again
+        static void stopUsing(const uint8_t *begin, const uint8_t *end)
+        {
+            for (uint8_t i = 0; i < count; i++)
+            {
+                Buzzer *b = table[i];
+                const uint8_t *tones = (const uint8_t *)b->melodyState.tones;
+                const uint8_t *pulses = (const uint8_t *)b->patternState.pulses;
+                if (b->melodyState.active && tones >= begin && tones < end)
+                    b->stopMelody();
+                if (b->patternState.active && pulses >= begin && pulses < end)
+                    b->stopPattern();
+                Lock lock;
+                uint8_t kept = 0;
+                for (uint8_t j = 0; j < b->queued; j++)
+                    if ((const uint8_t *)b->queue[j].data < begin || (const uint8_t *)b->queue[j].data >= end)
+                        b->queue[kept++] = b->queue[j];
+                b->queued = kept;
+                if ((const uint8_t *)b->chained.data >= begin && (const uint8_t *)b->chained.data < end)
+                    b->chained.type = BUZ_SOUND_NONE;
+            }
+        }
+
+        // With a budget, channels left once began is budget microseconds ago wait for the next call, which starts with them
+        static bool step(uint16_t budget = 0, uint32_t began = 0)
+        {
+            if (!work)
+                return false;
+            uint32_t now = clockNow(); // The only clock read of a sequencer pass
+            serviceTone(now);
+            bool started = false;
+            bool busy = toneBusy();
+#ifdef BUZZER_USE_SD
+            busy |= streamOwner != nullptr || fetch.slot >= 0; // update() still has to refill or close a file
+#endif
+            uint8_t first = next < count ? next : 0;
+            for (uint8_t n = 0; n < count; n++)
+            {
+                uint8_t i = (uint8_t)(first + n) % count;
+                if (n && budget && micros() - began >= budget)
+                {
+                    next = i;
+                    busy = true;
+                    break;
+                }
+                started |= table[i]->step(now);
+            }
+            IrqLock lock; // Keeps a wake() from an ISR post() that lands after the steps above
+            for (uint8_t i = 0; i < count && !busy; i++)
+                busy = table[i]->running != 0;
+            work = busy;
+            return started;
+        }
+
+        static uint8_t next; // Channel a budgeted step() postponed, serviced first by the next one
+    };
+    Buzzer *Channels::table[BUZZER_MAX_CHANNELS];
+    uint8_t Channels::count = 0;
+    uint8_t Channels::next = 0;
+#ifdef BUZZER_USE_SD
+    Buzzer *Channels::streamOwner = nullptr;
+#endif
+
+    Buzzer::~Buzzer()
+    {
+        if (config.pin != 255)
+            setup(255, BUZ_SILENT);
+    }
+
+    bool Buzzer::setup(Config conf, uint8_t flags)
+    {
+        BUZ_TASK_CALL(bool, setup(conf, flags));
+        if (conf.pin == 255 && config.pin != 255)
+        {
+            stopMelody();
+            Channels::detach(this);
+            toneOff(config.pin);
+#ifdef BUZZER_USE_PWM
+            if (pwm.pin == config.pin)
+                pwm.pin = 255;
+#endif
+#ifdef BUZZER_USE_SYNTH
+            if (Synth::voice(config.pin) == BUZZER_SYNTH_VOICES)
+#endif
+                pinMode(config.pin, INPUT);
+            config = Config();
+            running = 0;
+            pulseState = Pulse();
+            patternState = Pattern();
+            melodyState = Melody();
+            programState = Program();
+            sweepState = Sweep();
+            return false;
+        }
+        if (conf.pin == config.pin && !(flags & BUZ_FORCE))
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX "Buzzer pin already initialized." ANSI_DEFAULT));
+#endif
+            return true;
+        }
+        if (!Channels::attach(this))
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Too many buzzer channels!" ANSI_DEFAULT));
+#endif
+            return false;
+        }
+
+        {
+            Lock lock;
+            config = Config(conf.pin);
+        }
+#ifdef BUZZER_USE_SYNTH
+        if (Synth::voice(conf.pin) < BUZZER_SYNTH_VOICES)
+        {
+            if (!Synth::begin())
+            {
+#ifndef BUZZER_SERIAL_DISABLE
+                if (!(flags & BUZ_SILENT))
+                    SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "BUZZER_SYNTH_PIN is not the OC1A pin!" ANSI_DEFAULT));
+#endif
+                Channels::detach(this);
+                Lock lock;
+                config = Config();
+                return false;
+            }
+        }
+        else
+#endif
+        {
+            pinMode(conf.pin, OUTPUT);
+            digitalWrite(conf.pin, LOW);
+        }
+#ifdef BUZZER_USE_PWM
+        if (pwm.pin == 255 && pwmAttach(conf.pin))
+            pwm.pin = conf.pin;
+#endif
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+            printConfig();
+#endif
+        if (flags & BUZ_BEEP)
+            pulseBlocking(3);
+        return true;
+    }
+
+    bool Buzzer::setup(uint8_t pin, uint8_t flags)
+    {
+        return setup(Config(pin), flags);
+    }
+
+    Pulse Buzzer::patternPulse(uint8_t index) const
+    {
+#ifdef BUZZER_USE_TONE_TABLE
+        if (patternState.source == BUZ_SRC_TABLE)
+        {
+            const TablePulse &r = ((const TablePulse *)patternState.pulses)[index];
+#ifdef BUZZER_USE_PWM
+            if (config.pin == pwm.pin)
+                pwmPreset(table.frequencies[r.frequency], table.settings[r.frequency]);
+#endif
+            return Pulse(r.pulses, table.frequencies[r.frequency], table.times[r.duration], table.times[r.interval], 0, true);
+        }
+#endif
+        const Pulse *p = &patternState.pulses[index];
+        if (patternState.source == BUZ_SRC_PROGMEM)
+            return Pulse(pgm_read_byte(&p->pulses), pgm_read_word(&p->frequency), pgm_read_word(&p->duration), pgm_read_word(&p->interval), 0, true);
+        return Pulse(p->pulses, p->frequency, p->duration, p->interval, 0, true);
+    }
+
+    bool Buzzer::advancePattern()
+    {
+        if (!patternState.active || patternState.pulses == nullptr || patternState.count == 0)
+        {
+            patternState.active = false;
+            return false;
+        }
+        patternState.current++;
+        if (patternState.current >= patternState.count)
+        {
+            if (patternState.repeat)
+                patternState.current = 0;
+            else
+            {
+                patternState.active = false;
+                return false;
+            }
+        }
+        pulseState = patternPulse(patternState.current);
+        return true;
+    }
+
+    // Fetches the current melody tone, returns false once the melody has run out of tones
+    bool Buzzer::melodyTone(Tone &out) const
+    {
+#ifdef BUZZER_USE_SD
+        if (melodyState.source == BUZ_SRC_STREAM)
+        {
+            if (!streamCount())
+                return false;
+            out = streamState.ring[streamState.head % BUZZER_STREAM_TONES];
+            return true;
+        }
+#endif
+        if (melodyState.source == BUZ_SRC_PACKED || melodyState.source == BUZ_SRC_PACKED_P)
+        {
+            out = packedState.tone;
+            return !packedState.ended;
+        }
+        if (melodyState.current >= melodyState.count)
+            return false;
+#ifdef BUZZER_USE_TONE_TABLE
+        if (melodyState.source == BUZ_SRC_TABLE)
+        {
+            const TableTone &r = ((const TableTone *)melodyState.tones)[melodyState.current];
+            out = Tone(table.frequencies[r.frequency], table.times[r.duration], table.times[r.rest]);
+            return true;
+        }
+#endif
+        const Tone *t = &melodyState.tones[melodyState.current];
+        if (melodyState.source == BUZ_SRC_SCORE)
+            t = &((const ScoreTone *)melodyState.tones)[melodyState.current].tone;
+        if (melodyState.source == BUZ_SRC_PROGMEM || melodyState.source == BUZ_SRC_SCORE)
+            out = Tone(pgm_read_word(&t->frequency), pgm_read_word(&t->duration), pgm_read_word(&t->rest));
+        else
+            out = *t;
+        return true;
+    }
+
+    void Buzzer::nextMelodyTone()
+    {
+#ifdef BUZZER_USE_SD
+        if (melodyState.source == BUZ_SRC_STREAM)
+        {
+            streamState.head++;
+            return;
+        }
+#endif
+        if (melodyState.source == BUZ_SRC_PACKED || melodyState.source == BUZ_SRC_PACKED_P)
+        {
+            decodePacked();
+            return;
+        }
+        melodyState.current++;
+    }
+
+    uint8_t Buzzer::packedByte(uint16_t pos) const
+    {
+        if (pos >= packedState.size)
+            return BUZ_PK_END;
+        const uint8_t *p = (const uint8_t *)melodyState.tones + pos;
+        return melodyState.source == BUZ_SRC_PACKED_P ? pgm_read_byte(p) : *p;
+    }
+
+    // Restarts decoding after the length table and decodes the first tone
+    void Buzzer::rewindPacked()
+    {
+        packedState = PackedCursor(packedState.size);
+        packedState.pos = 1 + 4 * packedByte(0);
+        decodePacked();
+    }
+
+    // Decodes the next tone into packedState.tone, there is no decompressed copy of the melody
+    void Buzzer::decodePacked()
+    {
+        PackedCursor &c = packedState;
+        if (c.run)
+        {
+            c.run--;
+            return;
+        }
+        while (c.pos < c.size)
+        {
+            uint8_t op = packedByte(c.pos++);
+            if (op & 0x80 || (op & 0xE0) == 0x20) // Note or rest
+            {
+                uint8_t length = op & 0x07;
+                uint16_t frequency = 0;
+                if (op & 0x80)
+                {
+                    c.key += ((op >> 3) & 0x0F) - 8;
+                    frequency = keyFrequency(c.key);
+                }
+                if (length < packedByte(0))
+                {
+                    uint16_t at = 1 + 4 * length;
+                    c.tone = Tone(frequency, packedByte(at) | (packedByte(at + 1) << 8), packedByte(at + 2) | (packedByte(at + 3) << 8));
+                }
+                else
+                    c.tone = Tone(frequency, 0, 0);
+                return;
+            }
+            if (op & 0x40) // Repeat
+            {
+                c.run = (op & 0x3F) - 1;
+                return;
+            }
+            switch (op)
+            {
+            case 0x01: // Key
+                c.key = packedByte(c.pos++);
+                break;
+            case 0x02: // Loop
+                if (c.depth < 2)
+                {
+                    c.loopsLeft[c.depth] = packedByte(c.pos) ? packedByte(c.pos) : 1;
+                    c.loopStart[c.depth++] = c.pos + 1;
+                }
+                c.pos++;
+                break;
+            case 0x03: // Next
+                if (c.depth && --c.loopsLeft[c.depth - 1])
+                    c.pos = c.loopStart[c.depth - 1];
+                else if (c.depth)
+                    c.depth--;
+                break;
+            case BUZ_PK_END:
+                c.pos = c.size;
+                break;
+            }
+        }
+        c.ended = true;
+    }
+
+    // Marks engines as started, so the next step() services them; called with the lock held
+    void Buzzer::wake(uint8_t engines)
+    {
+        running |= engines;
+        work = true;
+    }
+
+    // Engines that still need step(), from their state
+    uint8_t Buzzer::runState() const
+    {
+        uint8_t engines = 0;
+        if (queued || sound.type != BUZ_SOUND_NONE)
+            engines |= BUZ_RUN_QUEUE;
+        if (pulseState.active)
+            engines |= BUZ_RUN_PULSE;
+        if (patternState.active)
+            engines |= BUZ_RUN_PATTERN;
+        if (melodyState.active)
+            engines |= BUZ_RUN_MELODY;
+        if (programState.active)
+            engines |= BUZ_RUN_PROGRAM;
+        if (sweepState.active)
+            engines |= BUZ_RUN_SWEEP;
+#ifdef BUZZER_TIMEBASE_US
+        if (pulseSounding)
+            engines |= BUZ_RUN_SOUNDING;
+#endif
+        return engines;
+    }
+
+    // Runs from update() or the timer ISR; an idle channel costs one test
+    bool Buzzer::step(uint32_t now)
+    {
+        if (!running)
+            return false;
+        bool started = stepEngines(now);
+        if (chainStep)
+        {
+            chainStep = false;
+            started = stepEngines(now) || started; // The chained sound starts in the step the last one ended in
+        }
+        if (chainAt && (int32_t)(now - chainAt) >= 0)
+            chainAt = 0; // Due and taken, or the chained sound did not start
+        IrqLock lock; // An ISR post() between the recompute and the store would lose its wake
+        running = runState();
+        return started;
+    }
+
+    // Advances the pulse, pattern and melody engines
+    bool Buzzer::stepEngines(uint32_t now)
+    {
+        if (running & BUZ_RUN_QUEUE)
+            serviceQueue(now);
+        if (config.pin == 255)
+            return false;
+#ifdef BUZZER_USE_STATS
+        uint32_t due = toneDue ? toneDue : now; // A boundary the previous step crossed starts its tone in this one
+        toneDue = 0;
+#endif
+        if (pulseState.active || patternState.active)
+        {
+            // The pulse group owns the pin, a program continues with its next op and a sweep retunes once it is done
+            programState.timing = false;
+            programState.frequency = 0;
+            sweepState.frequency = 0;
+        }
+#ifdef BUZZER_TIMEBASE_US
+        if (pulseSounding && now - pulseState.last >= BUZ_TICKS(pulseState.duration))
+        {
+            toneOff(config.pin);
+            pulseSounding = false;
+        }
+#endif
+        if (pulseState.active)
+        {
+            bool started = false;
+            if (pulseState.pulses > 0)
+            {
+                if (pulseState.last == 0 && chainAt && (int32_t)(now - chainAt) < 0)
+                    return false; // Chained behind a sound that is due to end later
+                if (pulseState.last == 0 || (now - pulseState.last) >= BUZ_TICKS(pulseState.interval + pulseState.duration))
+                {
+#ifdef BUZZER_USE_STATS
+                    statsTone(pulseState.last ? pulseState.last + BUZ_TICKS(pulseState.interval + pulseState.duration) : chainAt ? chainAt : due, now);
+#endif
+                    if (pulseState.last == 0 && patternState.active && patternStepCallback)
+                        patternStepCallback(patternStepContext, patternState.current);
+                    BUZ_TONE(config.pin, pulseState.frequency, pulseState.duration);
+                    toneStarted(pulseState.frequency, pulseState.duration);
+                    pulseState.last = pulseState.last == 0 && chainAt ? chainAt : now;
+                    chainAt = 0;
+                    started = true;
+                    pulseState.pulses--;
+#ifdef BUZZER_TIMEBASE_US
+                    pulseSounding = true;
+#endif
+                }
+            }
+            else if (patternState.active || now - pulseState.last >= BUZ_TICKS(pulseState.duration))
+            {
+                pulseState.active = false;
+                if (patternState.active)
+                {
+                    patternState.lastPulseEnd = now + BUZ_TICKS(pulseState.duration);
+                    patternState.waitingForDelay = true;
+                }
+                else
+                {
+                    finished(BUZ_FINISHED_PULSE);
+                    handOff(pulseState.last + BUZ_TICKS((uint32_t)pulseState.duration + pulseState.interval));
+                }
+            }
+            return started;
+        }
+
+        if (patternState.active && patternState.waitingForDelay)
+        {
+            if ((int32_t)(now - patternState.lastPulseEnd) >= (int32_t)BUZ_TICKS(patternState.pulseDelay))
+            {
+#ifdef BUZZER_USE_STATS
+                toneDue = patternState.lastPulseEnd + BUZ_TICKS(patternState.pulseDelay);
+#endif
+                patternState.waitingForDelay = false;
+                if (!advancePattern())
+                {
+                    finished(BUZ_FINISHED_PATTERN);
+                    handOff(patternState.lastPulseEnd + BUZ_TICKS(patternState.pulseDelay));
+                }
+            }
+        }
+        else if (patternState.active && !pulseState.active && !patternState.waitingForDelay && !advancePattern())
+        {
+            finished(BUZ_FINISHED_PATTERN);
+            handOff(now);
+        }
+
+#ifdef BUZZER_TIMEBASE_US
+        if (pulseSounding)
+            return false; // Let the last pulse finish before the melody takes over
+#endif
+        if (pulseState.active || patternState.active)
+            return false; // The pulse group holds back the sweep, program and melody engines
+        if (sweepState.active)
+            return stepSweep();
+        if (programState.active)
+            return stepProgram(now); // A running program holds back the melody
+        if (melodyState.active)
+        {
+            Tone currentTone;
+            if (melodyTone(currentTone))
+            {
+                if (melodyState.toneStart == 0)
+                {
+                    if (chainAt && (int32_t)(now - chainAt) < 0)
+                        return false; // Chained behind a sound that is due to end later
+                    melodyState.toneStart = chainAt ? chainAt : now;
+                    melodyState.playingTone = true;
+#ifdef BUZZER_USE_PWM
+                    if (melodyState.source == BUZ_SRC_SCORE && config.pin == pwm.pin)
+                    {
+                        const PwmSetting *timer = &((const ScoreTone *)melodyState.tones)[melodyState.current].timer;
+                        pwmPreset(currentTone.frequency, PwmSetting(pgm_read_dword(&timer->top), pgm_read_byte(&timer->prescaler)));
+                    }
+#ifdef BUZZER_USE_TONE_TABLE
+                    if (melodyState.source == BUZ_SRC_TABLE && config.pin == pwm.pin)
+                        pwmPreset(currentTone.frequency, table.settings[((const TableTone *)melodyState.tones)[melodyState.current].frequency]);
+#endif
+#endif
+                    if (currentTone.frequency > 0)
+                    {
+#ifdef BUZZER_USE_STATS
+                        statsTone(chainAt ? chainAt : due, now);
+#endif
+                        BUZ_TONE(config.pin, currentTone.frequency, currentTone.duration);
+                        toneStarted(currentTone.frequency, currentTone.duration);
+                    }
+                    chainAt = 0;
+                }
+                else if (melodyState.playingTone)
+                {
+                    if (now - melodyState.toneStart >= BUZ_TICKS(currentTone.duration))
+                    {
+                        melodyState.playingTone = false;
+                        toneOff(config.pin);
+                    }
+                }
+                else
+                {
+                    if (now - melodyState.toneStart >= BUZ_TICKS((uint32_t)currentTone.duration + currentTone.rest))
+                    {
+                        uint32_t end = melodyState.toneStart + BUZ_TICKS((uint32_t)currentTone.duration + currentTone.rest);
+#ifdef BUZZER_USE_STATS
+                        toneDue = end;
+#endif
+                        nextMelodyTone();
+                        melodyState.toneStart = 0;
+                        if (chained.type != BUZ_SOUND_NONE && !melodyState.repeat && melodyState.source != BUZ_SRC_STREAM && !melodyTone(currentTone))
+                        {
+                            melodyState.active = false; // The last rest is over, the chained sound starts where it was due
+                            finished(BUZ_FINISHED_MELODY);
+                            handOff(end);
+                        }
+                    }
+                }
+            }
+            else
+            {
+#ifdef BUZZER_USE_SD
+                if (melodyState.source == BUZ_SRC_STREAM)
+                {
+                    if (!streamState.eof)
+                        return false; // Waiting for the next chunk
+                    melodyState.active = false; // The file is closed by update()
+                    finished(BUZ_FINISHED_MELODY);
+                    handOff(now);
+                }
+                else
+#endif
+                if (melodyState.repeat)
+                {
+                    melodyState.current = 0;
+                    melodyState.toneStart = 0;
+                    melodyState.playingTone = false;
+                    if (melodyState.source == BUZ_SRC_PACKED || melodyState.source == BUZ_SRC_PACKED_P)
+                        rewindPacked();
+                }
+                else
+                {
+                    melodyState.active = false;
+                    finished(BUZ_FINISHED_MELODY);
+                    handOff(now);
+                }
+            }
+        }
+
+        return false;
+    }
+
+    static void drainMailbox()
+    {
+#ifdef BUZZER_USE_TASK
+        static bool draining = false;
+        if (draining)
+            return; // A blocking call run from here polls update(), later commands wait until it returns
+        draining = true;
+#endif
+        Command cmd;
+        while (takeCommand(cmd))
+        {
+            switch (cmd.op)
+            {
+            case BUZ_CMD_BEEP:
+                cmd.target->beep(cmd.frequency, cmd.duration);
+                break;
+            case BUZ_CMD_PULSE:
+                cmd.target->pulse(cmd.count, cmd.frequency, cmd.duration, cmd.interval);
+                break;
+            case BUZ_CMD_STOP:
+                cmd.target->clearQueue();
+                cmd.target->stopPattern();
+                cmd.target->stopMelody();
+                cmd.target->stopProgram();
+                cmd.target->stopSweep();
+                break;
+#ifdef BUZZER_USE_TASK
+            case BUZ_CMD_MELODY:
+                if (cmd.sound.type == BUZ_SOUND_MELODY_P)
+                    cmd.target->melody_P((const Tone *)cmd.sound.data, cmd.sound.count, cmd.sound.flags & BUZ_REPEAT);
+                else
+                    cmd.target->melody((Tone *)cmd.sound.data, cmd.sound.count, cmd.sound.flags & BUZ_REPEAT);
+                break;
+            case BUZ_CMD_PATTERN:
+                if (cmd.sound.type == BUZ_SOUND_PATTERN_P)
+                    cmd.target->pattern_P((const Pulse *)cmd.sound.data, cmd.sound.count, cmd.sound.flags & BUZ_REPEAT, cmd.sound.interval);
+                else
+                    cmd.target->pattern((Pulse *)cmd.sound.data, cmd.sound.count, cmd.sound.flags & BUZ_REPEAT, cmd.sound.interval);
+                break;
+            case BUZ_CMD_STOP_PATTERN:
+                cmd.target->stopPattern();
+                break;
+            case BUZ_CMD_STOP_MELODY:
+                cmd.target->stopMelody();
+                break;
+            case BUZ_CMD_POST:
+                cmd.target->post(cmd.sound);
+                break;
+            case BUZ_CMD_CLEAR:
+                cmd.target->clearQueue();
+                break;
+            case BUZ_CMD_CALL:
+            {
+                TaskCall *call = (TaskCall *)cmd.sound.data;
+                call->run(call->fn);
+                __atomic_store_n(&call->done, true, __ATOMIC_RELEASE);
+                break;
+            }
+#endif
+            }
+#ifdef BUZZER_USE_TASK
+            __atomic_store_n(&mailbox.done, (uint8_t)(mailbox.done + 1), __ATOMIC_RELEASE);
+#endif
+        }
+#ifdef BUZZER_USE_TASK
+        draining = false;
+#endif
+    }
+
+    // Keeps the earliest of the deadlines seen so far, comparing wrap-safe
+    static void earliest(uint32_t &deadline, bool &found, uint32_t at)
+    {
+        if (!found || (int32_t)(at - deadline) < 0)
+            deadline = at;
+        found = true;
+    }
+
+    bool Buzzer::nextDeadline(uint32_t &deadline) const
+    {
+        if (config.pin == 255)
+            return false;
+        uint32_t now = clockNow();
+        bool found = false;
+        if (queued && (sound.type == BUZ_SOUND_NONE || queue[0].priority > sound.priority))
+            earliest(deadline, found, now);
+        if ((sound.type == BUZ_SOUND_BEEP || sound.type == BUZ_SOUND_PULSE) && !pulseState.active)
+            earliest(deadline, found, pulseState.last + BUZ_TICKS(pulseState.duration));
+#ifdef BUZZER_TIMEBASE_US
+        if (pulseSounding)
+            earliest(deadline, found, pulseState.last + BUZ_TICKS(pulseState.duration));
+#endif
+
+        // Mirrors step(): an active pulse group holds back the pattern and melody engines
+        if (pulseState.active)
+        {
+            if (pulseState.last == 0 && chainAt && pulseState.pulses)
+                earliest(deadline, found, chainAt);
+            else if (pulseState.pulses == 0 && !patternState.active)
+                earliest(deadline, found, pulseState.last + BUZ_TICKS(pulseState.duration)); // The last beep rings out
+            else if (pulseState.pulses == 0 || pulseState.last == 0)
+                earliest(deadline, found, now);
+            else
+                earliest(deadline, found, pulseState.last + BUZ_TICKS(pulseState.interval + pulseState.duration));
+        }
+        else if (patternState.active)
+        {
+            if (patternState.waitingForDelay)
+                earliest(deadline, found, patternState.lastPulseEnd + BUZ_TICKS(patternState.pulseDelay));
+            else
+                earliest(deadline, found, now);
+        }
+        else if (sweepState.active)
+        {
+#ifdef BUZZER_TIMEBASE_US
+            earliest(deadline, found, sweepState.nextStep);
+#else
+            earliest(deadline, found, now); // Steps are finer than the millis() clock
+#endif
+        }
+        else if (programState.active)
+        {
+            if (!programState.timing)
+                earliest(deadline, found, now);
+            else
+            {
+                earliest(deadline, found, programState.opStart + BUZ_TICKS(programState.length));
+                if (programState.ramping)
+                    earliest(deadline, found, programState.lastRetune + BUZ_TICKS(BUZ_MS(BUZZER_RAMP_STEP)));
+            }
+        }
+        else if (melodyState.active)
+        {
+            Tone currentTone;
+            if (!melodyTone(currentTone) || melodyState.toneStart == 0)
+                earliest(deadline, found, melodyState.toneStart == 0 && chainAt ? chainAt : now);
+            else if (melodyState.playingTone)
+                earliest(deadline, found, melodyState.toneStart + BUZ_TICKS(currentTone.duration));
+            else
+                earliest(deadline, found, melodyState.toneStart + BUZ_TICKS((uint32_t)currentTone.duration + currentTone.rest));
+        }
+        return found;
+    }
+
+    bool Channels::nextDeadline(uint32_t &deadline)
+    {
+        bool found = false;
+        if (mailbox.head != mailbox.tail)
+            earliest(deadline, found, clockNow());
+#ifdef BUZZER_USE_PWM
+        if (pwm.timed)
+            earliest(deadline, found, pwm.offAt);
+        if (pwm.sounding && pwm.stage < BUZZER_ENVELOPE_STEPS)
+            earliest(deadline, found, pwm.stageAt);
+#endif
+#ifdef BUZZER_USE_SYNTH
+        for (uint8_t i = 0; i < BUZZER_SYNTH_VOICES; i++)
+            if (Synth::timed[i])
+                earliest(deadline, found, Synth::offAt[i]);
+#endif
+#ifdef BUZZER_USE_SD
+        if (streamOwner != nullptr && !streamState.eof && streamCount() <= BUZZER_STREAM_TONES / 2)
+            earliest(deadline, found, clockNow());
+#endif
+        for (uint8_t i = 0; i < count; i++)
+        {
+            uint32_t at;
+            if (table[i]->nextDeadline(at))
+                earliest(deadline, found, at);
+        }
+        return found;
+    }
+
+    bool nextDeadline(uint32_t &deadline)
+    {
+        return Channels::nextDeadline(deadline);
+    }
+
+    // Idles the CPU until the next interrupt; timers stay clocked so tone output keeps running
+    static void idle()
+    {
+#if defined(BUZZER_NOUSE_SLEEP) || defined(BUZZER_USE_TASK)
+        delay(1); // With BUZZER_USE_TASK the caller waits on the sequencer task and must let it run
+#elif defined(ARDUINO_ARCH_AVR)
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sleep_cpu();
+        sleep_disable();
+#elif defined(__arm__)
+        __WFI();
+#else
+        delay(1);
+#endif
+    }
+
+    // Lets the sequencer task run the commands posted so far before a blocking variant polls its state
+    static void waitForTask()
+    {
+#ifdef BUZZER_USE_TASK
+        if (onSequencer())
+            return; // The call changed the state directly
+        uint8_t target = __atomic_load_n(&mailbox.tail, __ATOMIC_ACQUIRE);
+        while ((int8_t)(__atomic_load_n(&mailbox.done, __ATOMIC_ACQUIRE) - target) < 0)
+            idle();
+#endif
+    }
+
+    // Used by the blocking variants instead of spinning on update()
+    static void waitForDeadline()
+    {
+        uint32_t deadline;
+        if (!nextDeadline(deadline))
+            return;
+#ifdef BUZZER_TIMEBASE_US
+        // Sleep only while the millis() tick cannot overshoot the deadline, then spin on micros()
+        while ((int32_t)(deadline - BUZ_CLOCK()) > 1100)
+            idle();
+        while ((int32_t)(deadline - BUZ_CLOCK()) > 0)
+            ;
+#else
+        while ((int32_t)(deadline - millis()) > 0)
+            idle(); // The millis() tick wakes the CPU at least every millisecond
+#endif
+    }
+
+    // A budget in microseconds runs the engines first and postpones what does not fit, 0 runs everything
+    static bool serviceAll(uint16_t budget)
+    {
+        if (!work && mailbox.head == mailbox.tail)
+            return false; // Idle: nothing is playing and no ISR command is pending
+        if (mailbox.head != mailbox.tail)
+            drainMailbox();
+#if !defined(BUZZER_USE_TIMER) || defined(BUZZER_USE_SD)
+        uint32_t began = micros();
+#endif
+#ifndef BUZZER_USE_TIMER
+        bool started = false;
+        if (budget)
+            started = Channels::step(budget, began); // Note timing first, file reads get what is left
+#endif
+#ifdef BUZZER_USE_SD
+        if (!budget || micros() - began < budget)
+            Channels::serviceStream();
+        uint32_t spent = micros() - began;
+        if (!budget || spent < budget)
+            servicePrefetch(budget && budget - spent < fetch.budget ? budget - spent : fetch.budget);
+#endif
+#ifdef BUZZER_USE_TIMER
+        BUZ_BARRIER();
+        return false; // The timer ISR runs the sequencer
+#else
+        return budget ? started : Channels::step();
+#endif
+    }
+
+    bool update(uint16_t budget)
+    {
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+            return false; // runTask() runs the sequencer, update() only serves calls made on it
+#endif
+#ifdef BUZZER_USE_STATS
+        uint32_t began = BUZ_COST_CLOCK();
+        bool started = serviceAll(budget);
+        statsUpdate(BUZ_COST_CLOCK() - began);
+        return started;
+#else
+        return serviceAll(budget);
+#endif
+    }
+
+#ifdef BUZZER_USE_TASK
+    // Longest wait while a file streams or prefetches, so the reads keep up with playback
+#define BUZ_TASK_FILE_WAIT_US 1000
+
+    // One pass of the sequencer task, then a sleep until the next deadline or a posted command
+    void runTask()
+    {
+#if defined(ARDUINO_ARCH_RP2040)
+        if (get_core_num() == 1)
+            sequencerStarted = true;
+#endif
+        update();
+        uint32_t deadline;
+        bool timed = nextDeadline(deadline);
+        int32_t left = timed ? (int32_t)(deadline - BUZ_CLOCK()) : 0;
+        uint32_t wait = left > 0 ? (uint32_t)left : 0;
+#ifndef BUZZER_TIMEBASE_US
+        wait *= 1000; // Deadlines are in milliseconds
+#endif
+#ifdef BUZZER_USE_SD
+        if (Channels::streamOwner || fetch.slot >= 0)
+        {
+            if (!timed || wait > BUZ_TASK_FILE_WAIT_US)
+                wait = BUZ_TASK_FILE_WAIT_US;
+            timed = true;
+        }
+#endif
+        if (timed && wait == 0)
+            return; // Due already, run again right away
+#if defined(ARDUINO_ARCH_ESP32)
+        if (timed && wait < portTICK_PERIOD_MS * 1000)
+            delayMicroseconds(wait); // Shorter than a scheduler tick, a command posted meanwhile waits for the next pass
+        else
+            ulTaskNotifyTake(pdTRUE, timed ? (TickType_t)(wait / (portTICK_PERIOD_MS * 1000)) : portMAX_DELAY);
+#else
+        if (timed)
+            best_effort_wfe_or_timeout(make_timeout_time_us(wait));
+        else
+            __wfe();
+#endif
+    }
+
+#if defined(ARDUINO_ARCH_ESP32)
+    static void taskMain(void *)
+    {
+        for (;;)
+            runTask();
+    }
+
+    static void startTask()
+    {
+        xTaskCreatePinnedToCore(taskMain, "AsyncBuzzer", BUZZER_TASK_STACK, nullptr, BUZZER_TASK_PRIORITY, &task, BUZZER_TASK_CORE);
+    }
+#endif
+#endif
+
+#ifdef BUZZER_USE_STATS
+    Stats getStats()
+    {
+        IrqLock lock; // Tone starts are recorded from the timer ISR with BUZZER_USE_TIMER
+        return stats;
+    }
+
+    void resetStats()
+    {
+        IrqLock lock;
+        stats = Stats();
+    }
+
+    void printStats(const String &message)
+    {
+#ifndef BUZZER_SERIAL_DISABLE
+        Stats s = getStats();
+#ifdef BUZZER_TIMEBASE_US
+#define BUZ_LATENCY_UNIT "us"
+#else
+#define BUZ_LATENCY_UNIT "ms"
+#endif
+        SERIAL.print(F(BUZ_LOG_PREFIX));
+        if (message.length())
+        {
+            SERIAL.print(message);
+            SERIAL.print(F(" "));
+        }
+        SERIAL.print(F("Updates: " ANSI_YELLOW));
+        SERIAL.print(s.updates);
+        SERIAL.print(F(ANSI_DEFAULT "  Cost: " ANSI_YELLOW));
+        SERIAL.print(s.updates ? s.minCost : 0);
+        SERIAL.print(F(ANSI_DEFAULT "/" ANSI_YELLOW));
+        SERIAL.print(s.updates ? s.totalCost / s.updates : 0);
+        SERIAL.print(F(ANSI_DEFAULT "/" ANSI_YELLOW));
+        SERIAL.print(s.maxCost);
+        SERIAL.print(s.cycles ? F(ANSI_DEFAULT " cycles") : F(ANSI_DEFAULT "us"));
+        SERIAL.print(F("  Tones: " ANSI_YELLOW));
+        SERIAL.print(s.tones);
+        SERIAL.print(F(ANSI_DEFAULT "  Late: " ANSI_YELLOW));
+        SERIAL.print(s.lastStart - s.lastDue);
+        SERIAL.print(F(ANSI_DEFAULT "/" ANSI_YELLOW));
+        SERIAL.print(s.maxLatency);
+        SERIAL.print(F(ANSI_DEFAULT BUZ_LATENCY_UNIT "  Histogram:" ANSI_YELLOW));
+        for (uint8_t i = 0; i < BUZZER_STATS_BUCKETS; i++)
+        {
+            SERIAL.print(F(" "));
+            SERIAL.print(s.latency[i]);
+        }
+        SERIAL.println(F(ANSI_DEFAULT));
+#undef BUZ_LATENCY_UNIT
+#endif
+    }
+#endif
+
+    Config Buzzer::getConfig() const
+    {
+        return config;
+    }
+
+    Config Buzzer::setConfig(Config conf, uint8_t flags)
+    {
+        BUZ_TASK_CALL(Config, setConfig(conf, flags));
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+            printConfig();
+#endif
+        return (config = conf);
+    }
+
+    void Buzzer::printConfig(const String &message)
+    {
+#ifndef BUZZER_SERIAL_DISABLE
+        SERIAL.print(F(BUZ_LOG_PREFIX));
+        if (message.length())
+        {
+            SERIAL.print(message);
+            SERIAL.print(F(" "));
+        }
+        SERIAL.print(F("Pin: " ANSI_YELLOW));
+        SERIAL.print(config.pin);
+        SERIAL.print(F(ANSI_DEFAULT "  Ack: " ANSI_YELLOW));
+        SERIAL.print(config.ack.frequency);
+        SERIAL.print(F(ANSI_DEFAULT "Hz/" ANSI_YELLOW));
+        SERIAL.print(config.ack.duration);
+        SERIAL.print(F(ANSI_DEFAULT "ms/" ANSI_YELLOW));
+        SERIAL.print(config.ack.rest);
+        SERIAL.print(F(ANSI_DEFAULT "ms  Err: " ANSI_YELLOW));
+        SERIAL.print(config.err.frequency);
+        SERIAL.print(F(ANSI_DEFAULT "Hz/" ANSI_YELLOW));
+        SERIAL.print(config.err.duration);
+        SERIAL.print(F(ANSI_DEFAULT "ms/" ANSI_YELLOW));
+        SERIAL.print(config.err.rest);
+        SERIAL.println(F(ANSI_DEFAULT "ms" ANSI_DEFAULT));
+#endif
+    }
+
+    void Buzzer::beep(uint16_t frequency, uint16_t duration)
+    {
+        if (config.pin == 255)
+            return;
+        if (frequency == BUZ_DEFAULT)
+            frequency = config.ack.frequency;
+        if (duration == BUZ_DEFAULT)
+            duration = config.ack.duration;
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+        {
+            sendCommand(this, BUZ_CMD_BEEP, 1, frequency, duration, 0);
+            return;
+        }
+#endif
+#ifdef BUZZER_TIMEBASE_US
+        toneOn(config.pin, frequency, (BUZ_TICKS(duration) + 999) / 1000); // Tone durations are whole milliseconds
+#else
+        toneOn(config.pin, frequency, duration);
+#endif
+    }
+
+    void Buzzer::pulse(uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval)
+    {
+        if (config.pin == 255 || count == 0)
+            return;
+        if (frequency == BUZ_DEFAULT)
+            frequency = config.ack.frequency;
+        if (duration == BUZ_DEFAULT)
+            duration = config.ack.duration;
+        if (interval == BUZ_DEFAULT)
+            interval = config.ack.rest;
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+        {
+            sendCommand(this, BUZ_CMD_PULSE, count, frequency, duration, interval);
+            return;
+        }
+#endif
+        Lock lock;
+        pulseState = Pulse(count, frequency, duration, interval, 0, true);
+        wake(BUZ_RUN_PULSE);
+    }
+
+    void Buzzer::pulseBlocking(uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval)
+    {
+        pulse(count, frequency, duration, interval);
+        waitForTask();
+        while (pulseState.pulses)
+        {
+            update();
+            waitForDeadline();
+        }
+    }
+
+    void Buzzer::pattern(Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay)
+    {
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+        {
+            if (config.pin != 255 && pulses && count)
+                sendSound(this, BUZ_CMD_PATTERN, Sound(BUZ_SOUND_PATTERN, 0, repeat ? BUZ_REPEAT : BUZ_NONE, pulses, count, 0, 0, pulseDelay));
+            return;
+        }
+#endif
+        startPattern(pulses, count, repeat, pulseDelay, BUZ_SRC_RAM, 0);
+    }
+
+    void Buzzer::pattern_P(const Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay)
+    {
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+        {
+            if (config.pin != 255 && pulses && count)
+                sendSound(this, BUZ_CMD_PATTERN, Sound(BUZ_SOUND_PATTERN_P, 0, repeat ? BUZ_REPEAT : BUZ_NONE, pulses, count, 0, 0, pulseDelay));
+            return;
+        }
+#endif
+        startPattern(pulses, count, repeat, pulseDelay, BUZ_SRC_PROGMEM, 0);
+    }
+
+    void Buzzer::startPattern(const Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay, uint8_t source, uint8_t start)
+    {
+        if (config.pin == 255 || pulses == nullptr || start >= count)
+            return;
+        Lock lock;
+        patternState = Pattern(pulses, count, start, true, repeat, pulseDelay, source);
+        pulseState = patternPulse(start);
+        wake(BUZ_RUN_PATTERN | BUZ_RUN_PULSE);
+    }
+
+    void Buzzer::patternBlocking(Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay)
+    {
+        pattern(pulses, count, repeat, pulseDelay);
+        waitForTask();
+        while (patternState.active || pulseState.active)
+        {
+            update();
+            waitForDeadline();
+        }
+    }
+
+    bool Buzzer::isPatternActive() const
+    {
+        return patternState.active;
+    }
+
+    void Buzzer::stopPattern()
+    {
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+        {
+            sendCommand(this, BUZ_CMD_STOP_PATTERN, 0, 0, 0, 0);
+            return;
+        }
+#endif
+        Lock lock;
+        patternState.active = false;
+        pulseState.active = false;
+        chained.type = BUZ_SOUND_NONE; // Stopping drops what was chained behind the sound
+        chainAt = 0;
+    }
+
+    void Buzzer::melody(Tone *tones, uint8_t count, bool repeat)
+    {
+        if (config.pin == 255 || tones == nullptr || count == 0)
+            return;
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+        {
+            sendSound(this, BUZ_CMD_MELODY, Sound(BUZ_SOUND_MELODY, 0, repeat ? BUZ_REPEAT : BUZ_NONE, tones, count));
+            return;
+        }
+#endif
+        stopMelody();
+        startMelody(tones, count, repeat, BUZ_SRC_RAM, 0);
+    }
+
+    void Buzzer::melody_P(const Tone *tones, uint8_t count, bool repeat)
+    {
+        if (config.pin == 255 || tones == nullptr || count == 0)
+            return;
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+        {
+            sendSound(this, BUZ_CMD_MELODY, Sound(BUZ_SOUND_MELODY_P, 0, repeat ? BUZ_REPEAT : BUZ_NONE, tones, count));
+            return;
+        }
+#endif
+        stopMelody();
+        startMelody(tones, count, repeat, BUZ_SRC_PROGMEM, 0);
+    }
+
+    void Buzzer::score(const ScoreTone *tones, uint8_t count, bool repeat)
+    {
+        BUZ_TASK_CALL_VOID(score(tones, count, repeat));
+        if (config.pin == 255 || tones == nullptr || count == 0)
+            return;
+        stopMelody();
+        startMelody((const Tone *)tones, count, repeat, BUZ_SRC_SCORE, 0);
+    }
+
+    void Buzzer::packedMelody(const uint8_t *data, uint16_t size, bool repeat)
+    {
+        BUZ_TASK_CALL_VOID(packedMelody(data, size, repeat));
+        if (config.pin == 255 || data == nullptr || size == 0)
+            return;
+        stopMelody();
+        Lock lock;
+        melodyState = Melody((const Tone *)data, 0, 0, true, repeat, BUZ_SRC_PACKED);
+        packedState = PackedCursor(size);
+        rewindPacked();
+        wake(BUZ_RUN_MELODY);
+    }
+
+    void Buzzer::packedMelody_P(const uint8_t *data, uint16_t size, bool repeat)
+    {
+        BUZ_TASK_CALL_VOID(packedMelody_P(data, size, repeat));
+        if (config.pin == 255 || data == nullptr || size == 0)
+            return;
+        stopMelody();
+        Lock lock;
+        melodyState = Melody((const Tone *)data, 0, 0, true, repeat, BUZ_SRC_PACKED_P);
+        packedState = PackedCursor(size);
+        rewindPacked();
+        wake(BUZ_RUN_MELODY);
+    }
+
+    void Buzzer::program(const uint8_t *code, uint16_t size)
+    {
+        BUZ_TASK_CALL_VOID(program(code, size));
+        startProgram(code, size, BUZ_SRC_RAM);
+    }
+
+    void Buzzer::program_P(const uint8_t *code, uint16_t size)
+    {
+        BUZ_TASK_CALL_VOID(program_P(code, size));
+        startProgram(code, size, BUZ_SRC_PROGMEM);
+    }
+
+    void Buzzer::startProgram(const uint8_t *code, uint16_t size, uint8_t source)
+    {
+        if (config.pin == 255 || code == nullptr || size == 0)
+            return;
+        stopMelody();
+        Lock lock;
+        programState = Program(code, size, source);
+        wake(BUZ_RUN_PROGRAM);
+    }
+
+    bool Buzzer::isProgramActive() const
+    {
+        return programState.active;
+    }
+
+    void Buzzer::stopProgram()
+    {
+        BUZ_TASK_CALL_VOID(stopProgram());
+        {
+            Lock lock;
+            programState.active = false;
+            programState.frequency = 0;
+        }
+        if (config.pin != 255)
+            toneOff(config.pin);
+    }
+
+    uint8_t Buzzer::programByte(uint16_t pos) const
+    {
+        if (pos >= programState.size)
+            return 0x00; // END
+        const uint8_t *p = programState.code + pos;
+        return programState.source == BUZ_SRC_PROGMEM ? pgm_read_byte(p) : *p;
+    }
+
+    // Operands are read a byte at a time, they are not aligned
+    uint16_t Buzzer::programWord(uint16_t pos) const
+    {
+        return programByte(pos) | (programByte(pos + 1) << 8);
+    }
+
+    // Runs program ops until one takes time; returns true when a tone starts
+    bool Buzzer::stepProgram(uint32_t now)
+    {
+        Program &p = programState;
+        if (p.timing)
+        {
+            uint32_t elapsed = now - p.opStart;
+            if (elapsed < BUZ_TICKS(p.length))
+            {
+                if (p.ramping && now - p.lastRetune >= BUZ_TICKS(BUZ_MS(BUZZER_RAMP_STEP)))
+                {
+                    p.lastRetune = now;
+                    // Elapsed time in Tone units and the span both fit 16 bits, so their product cannot overflow
+                    uint16_t span = p.rampTo > p.rampFrom ? p.rampTo - p.rampFrom : p.rampFrom - p.rampTo;
+                    uint16_t change = (uint16_t)((uint32_t)span * (elapsed / BUZ_TICKS(1)) / p.length);
+                    p.frequency = p.rampTo > p.rampFrom ? p.rampFrom + change : p.rampFrom - change;
+                    if (p.frequency)
+                        toneRetune(config.pin, p.frequency);
+                    else
+                        toneOff(config.pin);
+                }
+                return false;
+            }
+            if (p.ramping && p.frequency != p.rampTo && p.rampTo)
+                toneRetune(config.pin, p.rampTo);
+            if (p.ramping)
+                p.frequency = p.rampTo;
+            p.opStart += BUZ_TICKS(p.length); // Ops follow each other back to back, without drift
+        }
+        else
+            p.opStart = now;
+        p.timing = false;
+        p.ramping = false;
+
+        for (uint8_t ops = 0; ops < BUZZER_PROGRAM_OPS; ops++)
+        {
+            uint8_t op = programByte(p.pc);
+            switch (op)
+            {
+            case 0x01: // TONE frequency, duration
+            case 0x08: // RAMP frequency, duration
+            {
+                int32_t shifted = (int32_t)programWord(p.pc + 1) + p.offset;
+                uint16_t frequency = shifted < 0 ? 0 : shifted > 0xFFFF ? 0xFFFF : (uint16_t)shifted;
+                p.length = programWord(p.pc + 3);
+                p.pc += 5;
+                p.timing = true;
+                if (op == 0x08 && p.frequency)
+                {
+                    p.ramping = true;
+                    p.rampFrom = p.frequency;
+                    p.rampTo = frequency;
+                    p.lastRetune = p.opStart;
+                    return false;
+                }
+                if (frequency == p.frequency)
+                    return false; // Same tone continues without a gap
+                p.frequency = frequency;
+                if (frequency == 0)
+                {
+                    toneOff(config.pin);
+                    return false;
+                }
+#ifdef BUZZER_USE_STATS
+                statsTone(p.opStart, now);
+#endif
+                toneOn(config.pin, frequency, 0);
+                toneStarted(frequency, p.length);
+                return true;
+            }
+            case 0x02: // REST duration
+                if (p.frequency)
+                    toneOff(config.pin);
+                p.frequency = 0;
+                p.length = programWord(p.pc + 1);
+                p.pc += 3;
+                p.timing = true;
+                return false;
+            case 0x03: // LOOP passes
+                if (p.depth < 2)
+                {
+                    p.loopsLeft[p.depth] = programByte(p.pc + 1) ? programByte(p.pc + 1) : 1;
+                    p.loopStart[p.depth++] = p.pc + 2;
+                }
+                p.pc += 2;
+                break;
+            case 0x04: // NEXT
+                if (p.depth && --p.loopsLeft[p.depth - 1])
+                    p.pc = p.loopStart[p.depth - 1];
+                else
+                {
+                    if (p.depth)
+                        p.depth--;
+                    p.pc++;
+                }
+                break;
+            case 0x05: // JUMP offset, closes open loops
+                p.pc = programWord(p.pc + 1);
+                p.depth = 0;
+                break;
+            case 0x06: // SET_FREQ_OFFSET hz
+                p.offset = (int16_t)programWord(p.pc + 1);
+                p.pc += 3;
+                break;
+            case 0x07: // ADD_FREQ_OFFSET hz
+                p.offset += (int16_t)programWord(p.pc + 1);
+                p.pc += 3;
+                break;
+            case 0x09: // VOLUME level
+                setVolume(programByte(p.pc + 1));
+                p.pc += 2;
+                break;
+            default: // END, or an unknown op
+                p.active = false;
+                if (p.frequency)
+                    toneOff(config.pin);
+                p.frequency = 0;
+                finished(BUZ_FINISHED_PROGRAM);
+                return false;
+            }
+        }
+        return false; // Op budget used up, the program continues on the next call
+    }
+
+    void setVolume(uint8_t level)
+    {
+        BUZ_TASK_CALL_VOID(setVolume(level));
+#ifdef BUZZER_USE_PWM
+        IrqLock lock;
+        pwm.volume = level;
+        pwmLevel(pwm.amplitude);
+        if (pwm.sounding)
+            pwmWriteDuty();
+#else
+        (void)level;
+#endif
+    }
+
+    void setEnvelope(uint16_t attack, uint16_t decay, uint8_t sustain)
+    {
+        BUZ_TASK_CALL_VOID(setEnvelope(attack, decay, sustain));
+#ifdef BUZZER_USE_PWM
+        // All the division happens here, playing a note only steps through the table
+        Envelope shape;
+        uint32_t total = (uint32_t)attack + decay;
+        shape.stepTicks = BUZ_TICKS(total) / (BUZZER_ENVELOPE_STEPS - 1);
+        if (total && shape.stepTicks == 0)
+            shape.stepTicks = 1;
+        for (uint8_t i = 0; i < BUZZER_ENVELOPE_STEPS; i++)
+        {
+            uint32_t t = total * i / (BUZZER_ENVELOPE_STEPS - 1);
+            if (t < attack)
+                shape.levels[i] = (uint8_t)(255UL * t / attack);
+            else if (decay)
+                shape.levels[i] = (uint8_t)(255 - (255UL - sustain) * (t - attack) / decay);
+            else
+                shape.levels[i] = sustain;
+        }
+        IrqLock lock;
+        envelope = shape;
+#else
+        (void)attack;
+        (void)decay;
+        (void)sustain;
+#endif
+    }
+
+    void Buzzer::sweep(uint16_t from, uint16_t to, uint16_t duration, uint8_t curve, bool repeat)
+    {
+        BUZ_TASK_CALL_VOID(sweep(from, to, duration, curve, repeat));
+        if (config.pin == 255 || from == 0 || to == 0)
+            return;
+        stopMelody();
+        stopProgram();
+#ifdef BUZZER_TIMEBASE_US
+        uint32_t steps = BUZ_TICKS(duration) / BUZZER_SWEEP_STEP_US;
+#else
+        uint32_t steps = (uint32_t)duration * 1000UL / BUZZER_SWEEP_STEP_US;
+#endif
+        if (curve & BUZ_CURVE_BOUNCE)
+            steps /= 2;
+        if (steps < 2)
+            steps = 2;
+        if (!(curve & BUZ_CURVE_BOUNCE))
+            steps--; // The last step of the pass plays to
+        // Each step multiplies delta by its number, so the ends are exact and a late update() costs the same
+        Sweep s;
+        if ((curve & ~BUZ_CURVE_BOUNCE) == BUZ_CURVE_EXP)
+            s.delta = (pitchSpan(from, to) << 8) / (int32_t)steps;
+        else
+            s.delta = (int32_t)((((uint32_t)(to > from ? to - from : from - to)) << 16) / steps);
+        s.from = from;
+        s.to = to;
+        s.curve = curve;
+        s.repeat = repeat;
+        s.steps = steps;
+        s.start = micros();
+        s.nextStep = s.start;
+        s.active = true;
+        Lock lock;
+        sweepState = s;
+        wake(BUZ_RUN_SWEEP);
+    }
+
+    bool Buzzer::isSweepActive() const
+    {
+        return sweepState.active;
+    }
+
+    void Buzzer::stopSweep()
+    {
+        BUZ_TASK_CALL_VOID(stopSweep());
+        {
+            Lock lock;
+            if (!sweepState.active)
+                return;
+            sweepState.active = false;
+        }
+        if (config.pin != 255)
+            toneOff(config.pin);
+    }
+
+    // Works out the step due from the time since the pass started and retunes once; returns true when the tone starts
+    bool Buzzer::stepSweep()
+    {
+        Sweep &s = sweepState;
+        uint32_t us = micros();
+        if (s.frequency != 0 && (int32_t)(us - s.nextStep) < 0)
+            return false;
+        uint32_t pass = s.curve & BUZ_CURVE_BOUNCE ? 2 * s.steps : s.steps + 1; // Steps in one pass
+        uint32_t step = (us - s.start) / BUZZER_SWEEP_STEP_US;
+        if (step >= pass)
+        {
+            if (!s.repeat)
+            {
+                s.active = false;
+                toneOff(config.pin);
+                finished(BUZ_FINISHED_SWEEP);
+                return false;
+            }
+            uint32_t passes = step / pass; // More than one if update() was held up for longer than a pass
+            s.start += passes * pass * BUZZER_SWEEP_STEP_US;
+            step -= passes * pass;
+        }
+        s.nextStep = s.start + (step + 1) * BUZZER_SWEEP_STEP_US;
+        if (step > s.steps)
+            step = 2 * s.steps - step; // On the way back of a bounce
+        uint16_t frequency;
+        if (step == s.steps)
+            frequency = s.to;
+        else if ((s.curve & ~BUZ_CURVE_BOUNCE) == BUZ_CURVE_EXP)
+            frequency = pitchFrequency(s.from, (s.delta * (int32_t)step) >> 8);
+        else
+        {
+            uint16_t offset = (uint16_t)(((uint32_t)s.delta * step) >> 16);
+            frequency = s.to > s.from ? s.from + offset : s.from - offset;
+        }
+        if (frequency == s.frequency || frequency == 0)
+            return false;
+        bool started = s.frequency == 0;
+        if (started)
+            toneOn(config.pin, frequency, 0);
+        else
+            toneRetune(config.pin, frequency);
+        s.frequency = frequency;
+        return started;
+    }
+
+    // Replaces the melody state without touching the SD stream, which is closed from update()
+    void Buzzer::startMelody(const Tone *tones, uint8_t count, bool repeat, uint8_t source, uint8_t start)
+    {
+        if (config.pin == 255 || tones == nullptr || start >= count)
+            return;
+        Lock lock;
+        melodyState = Melody(tones, count, start, true, repeat, source);
+        wake(BUZ_RUN_MELODY);
+    }
+
+    void Buzzer::melodyBlocking(Tone *tones, uint8_t count, bool repeat)
+    {
+#ifdef BUZZER_USE_TASK
+        (void)repeat;
+        melody(tones, count, false); // Plays once either way, the task owns the state once it is posted
+        waitForTask();
+#else
+        melody(tones, count, repeat);
+        {
+            Lock lock;
+            melodyState.repeat = false;
+        }
+#endif
+        while (melodyState.active)
+        {
+            update();
+            waitForDeadline();
+        }
+    }
+
+    bool Buzzer::isMelodyActive() const
+    {
+        return melodyState.active;
+    }
+
+    void Buzzer::stopMelody()
+    {
+        {
+            Lock lock;
+            melodyState.active = false;
+            chained.type = BUZ_SOUND_NONE;
+            chainAt = 0;
+        }
+#ifdef BUZZER_USE_SD
+        if (Channels::streamOwner == this)
+        {
+            closeStream();
+            Channels::streamOwner = nullptr;
+        }
+#endif
+        if (config.pin != 255)
+            toneOff(config.pin);
+    }
+
+    bool Buzzer::beepFromISR(uint16_t frequency, uint16_t duration)
+    {
+        return config.pin != 255 && sendCommand(this, BUZ_CMD_BEEP, 1, frequency, duration, 0);
+    }
+
+    bool Buzzer::pulseFromISR(uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval)
+    {
+        return config.pin != 255 && count && sendCommand(this, BUZ_CMD_PULSE, count, frequency, duration, interval);
+    }
+
+    bool Buzzer::stopFromISR()
+    {
+        return config.pin != 255 && sendCommand(this, BUZ_CMD_STOP, 0, 0, 0, 0);
+    }
+
+    bool Buzzer::post(const Sound &sound)
+    {
+        if (config.pin == 255 || sound.type == BUZ_SOUND_NONE)
+            return false;
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+            return sendSound(this, BUZ_CMD_POST, sound); // True once queued for the task, the sound may still be dropped as lower priority
+#endif
+        IrqLock lock;
+        return enqueue(sound, false);
+    }
+
+    uint8_t Buzzer::queuedSounds() const
+    {
+        return queued;
+    }
+
+    void Buzzer::clearQueue()
+    {
+#ifdef BUZZER_USE_TASK
+        if (!onSequencer())
+        {
+            sendCommand(this, BUZ_CMD_CLEAR, 0, 0, 0, 0);
+            return;
+        }
+#endif
+        IrqLock lock;
+        queued = 0;
+    }
+
+    // Plays sound the moment the current one ends, in the same step; with nothing playing it starts right away
+    bool Buzzer::chain(const Sound &sound, void (*finished)(void *context), void *context)
+    {
+        BUZ_TASK_CALL(bool, chain(sound, finished, context));
+        if (config.pin == 255 || sound.type == BUZ_SOUND_NONE)
+            return false;
+        IrqLock lock;
+        if (chained.type != BUZ_SOUND_NONE)
+            return false; // One sound waits at a time, chain the next one from the callback
+        chained = sound;
+        chainFinished = finished;
+        chainContext = context;
+        bool playing = pulseState.active || patternState.active || melodyState.active;
+#ifdef BUZZER_TIMEBASE_US
+        playing = playing || pulseSounding;
+#endif
+        if (!playing)
+            handOff(0);
+        return true;
+    }
+
+    bool Buzzer::isChained() const
+    {
+        return chained.type != BUZ_SOUND_NONE;
+    }
+
+    void Buzzer::onToneStart(void (*callback)(void *context, uint16_t frequency, uint16_t duration), void *context)
+    {
+        BUZ_TASK_CALL_VOID(onToneStart(callback, context));
+        IrqLock lock;
+        toneStartCallback = callback;
+        toneStartContext = context;
+    }
+
+    void Buzzer::onPatternStep(void (*callback)(void *context, uint8_t index), void *context)
+    {
+        BUZ_TASK_CALL_VOID(onPatternStep(callback, context));
+        IrqLock lock;
+        patternStepCallback = callback;
+        patternStepContext = context;
+    }
+
+    void Buzzer::onFinished(void (*callback)(void *context, uint8_t sound), void *context)
+    {
+        BUZ_TASK_CALL_VOID(onFinished(callback, context));
+        IrqLock lock;
+        finishedCallback = callback;
+        finishedContext = context;
+    }
+
+    // Reports a pulse, melody note or program tone that just started
+    void Buzzer::toneStarted(uint16_t frequency, uint16_t duration)
+    {
+        if (toneStartCallback)
+            toneStartCallback(toneStartContext, frequency, duration);
+    }
+
+    // Reports a sound that ended on its own, before anything chained behind it starts
+    void Buzzer::finished(uint8_t sound)
+    {
+        if (finishedCallback)
+            finishedCallback(finishedContext, sound);
+    }
+
+    // Starts the chained sound where the current one was due to end and lets the callback chain the next one
+    void Buzzer::handOff(uint32_t due)
+    {
+        if (chained.type == BUZ_SOUND_NONE)
+            return;
+        Sound next = chained;
+        void (*finished)(void *) = chainFinished;
+        chained = Sound();
+        chainFinished = nullptr;
+        startSound(next);
+        chainAt = due;
+        chainStep = true;
+        if (finished)
+            finished(chainContext);
+    }
+
+    // Inserts behind sounds of higher priority (and equal priority unless front is set), evicting the lowest when full
+    bool Buzzer::enqueue(const Sound &sound, bool front)
+    {
+        uint8_t pos = 0;
+        while (pos < queued && (queue[pos].priority > sound.priority || (!front && queue[pos].priority == sound.priority)))
+            pos++;
+        if (queued == BUZZER_QUEUE_SIZE)
+        {
+            if (pos >= queued)
+                return false;
+            queued--;
+        }
+        for (uint8_t i = queued; i > pos; i--)
+            queue[i] = queue[i - 1];
+        queue[pos] = sound;
+        queued++;
+        wake(BUZ_RUN_QUEUE);
+        return true;
+    }
+
+    // Index the current posted sound would resume at
+    uint8_t Buzzer::soundPosition() const
+    {
+        switch (sound.type)
+        {
+        case BUZ_SOUND_BEEP:
+        case BUZ_SOUND_PULSE:
+            return sound.count - pulseState.pulses;
+        case BUZ_SOUND_PATTERN:
+        case BUZ_SOUND_PATTERN_P:
+            return patternState.current;
+        case BUZ_SOUND_MELODY:
+        case BUZ_SOUND_MELODY_P:
+            return melodyState.current;
+        }
+        return 0;
+    }
+
+    void Buzzer::startSound(const Sound &sound)
+    {
+        bool repeat = sound.flags & BUZ_REPEAT;
+        switch (sound.type)
+        {
+        case BUZ_SOUND_BEEP:
+            pulse(1, sound.frequency, sound.duration, 0);
+            break;
+        case BUZ_SOUND_PULSE:
+            if (sound.start < sound.count)
+                pulse(sound.count - sound.start, sound.frequency, sound.duration, sound.interval);
+            break;
+        case BUZ_SOUND_PATTERN:
+        case BUZ_SOUND_PATTERN_P:
+            startPattern((const Pulse *)sound.data, sound.count, repeat, sound.interval,
+                         sound.type == BUZ_SOUND_PATTERN_P ? BUZ_SRC_PROGMEM : BUZ_SRC_RAM, sound.start);
+            break;
+        case BUZ_SOUND_MELODY:
+        case BUZ_SOUND_MELODY_P:
+            startMelody((const Tone *)sound.data, sound.count, repeat,
+                        sound.type == BUZ_SOUND_MELODY_P ? BUZ_SRC_PROGMEM : BUZ_SRC_RAM, sound.start);
+            break;
+#ifdef BUZZER_USE_TONE_TABLE
+        case BUZ_SOUND_PATTERN_T:
+            startPattern((const Pulse *)sound.data, sound.count, repeat, sound.interval, BUZ_SRC_TABLE, sound.start);
+            break;
+        case BUZ_SOUND_MELODY_T:
+            startMelody((const Tone *)sound.data, sound.count, repeat, BUZ_SRC_TABLE, sound.start);
+            break;
+#endif
+        }
+    }
+
+    // Retires the finished posted sound and starts the next one, preempting lower priorities
+    void Buzzer::serviceQueue(uint32_t now)
+    {
+        IrqLock lock;
+        if (sound.type != BUZ_SOUND_NONE && !pulseState.active && !patternState.active && !melodyState.active)
+        {
+            // Let the last beep of a pulse group ring out before the next sound takes the pin
+            bool ringing = (sound.type == BUZ_SOUND_BEEP || sound.type == BUZ_SOUND_PULSE) && now - pulseState.last < BUZ_TICKS(pulseState.duration);
+            if (!ringing)
+                sound.type = BUZ_SOUND_NONE;
+        }
+        if (queued == 0 || (sound.type != BUZ_SOUND_NONE && queue[0].priority <= sound.priority))
+            return;
+        Sound next = queue[0];
+        queued--;
+        for (uint8_t i = 0; i < queued; i++)
+            queue[i] = queue[i + 1];
+        if (sound.type != BUZ_SOUND_NONE)
+        {
+            if (sound.flags & BUZ_RESUME)
+            {
+                Sound paused = sound;
+                paused.start = soundPosition();
+                enqueue(paused, true);
+            }
+            pulseState.active = false;
+            patternState.active = false;
+            melodyState.active = false;
+            toneOff(config.pin);
+        }
+        sound = next;
+        startSound(next);
+    }
+
+#ifdef BUZZER_USE_SD
+    // Start of the first free 4-byte aligned gap of at least want bytes between the used entries,
+    // or of the largest gap when want is 0; -1 if there is none
+    template <typename Entry, uint8_t N>
+    static int32_t findGap(const Entry (&entries)[N], uint16_t capacity, uint16_t want, uint16_t &length)
+    {
+        int32_t best = -1;
+        length = 0;
+        for (uint8_t i = 0; i <= N; i++)
+        {
+            uint32_t start = 0;
+            if (i < N)
+            {
+                if (!entries[i].used())
+                    continue;
+                start = ((uint32_t)entries[i].offset + entries[i].size + 3) & ~3UL;
+            }
+            uint32_t end = capacity;
+            for (uint8_t j = 0; j < N; j++)
+            {
+                const Entry &e = entries[j];
+                if (!e.used() || (uint32_t)e.offset + e.size <= start)
+                    continue;
+                if (e.offset <= start)
+                    end = 0; // start lies inside this entry
+                else if (e.offset < end)
+                    end = e.offset;
+            }
+            if (end <= start || end - start < (want ? want : 1) || (!want && end - start <= length))
+                continue;
+            best = (int32_t)start;
+            length = (uint16_t)(end - start);
+            if (want)
+                break;
+        }
+        return best;
+    }
+
+    static void alignBuffer(void *buffer, uint16_t size, uint8_t *&aligned, uint16_t &usable)
+    {
+        aligned = (uint8_t *)(((uintptr_t)buffer + 3) & ~(uintptr_t)3); // Pulse records hold 32-bit fields
+        uint16_t skipped = (uint16_t)(aligned - (uint8_t *)buffer);
+        usable = buffer != nullptr && size > skipped ? size - skipped : 0;
+        if (usable == 0)
+            aligned = nullptr;
+    }
+
+    // Decoded sound files kept in a caller-provided buffer, evicted least recently used first
+    struct CacheEntry
+    {
+        uint32_t hash;    // Hash of the file path, 0 if the entry is free
+        uint16_t check;   // Second, independent hash of the path
+        uint8_t length;   // Path length, up to 255
+        uint16_t offset;  // Byte offset of the records in the cache buffer
+        uint16_t size;    // Bytes held in the cache buffer
+        uint16_t lastUse; // Cache clock at the last hit
+        uint8_t kind;     // BUZ_FILE_TONES or BUZ_FILE_PULSES
+        uint8_t count;    // Records held
+        bool pending;     // Being filled by playFile(), not yet usable
+        bool used() const { return hash != 0; }
+    };
+
+    struct FileCache
+    {
+        uint8_t *buffer;
+        uint16_t size;
+        uint16_t clock;
+        CacheEntry entries[BUZZER_CACHE_FILES];
+    };
+    static FileCache cache;
+
+    // Paths are matched by two unrelated hashes and the length, so two paths that collide in one still differ
+    struct PathKey
+    {
+        uint32_t hash;
+        uint16_t check;
+        uint8_t length;
+    };
+
+    static PathKey pathKey(const String &path)
+    {
+        PathKey key = {2166136261UL, 5381, 0}; // FNV-1a and djb2
+        for (const char *c = path.c_str(); *c; c++)
+        {
+            key.hash = (key.hash ^ (uint8_t)*c) * 16777619UL;
+            key.check = (uint16_t)(key.check * 33 + (uint8_t)*c);
+            if (key.length < 255)
+                key.length++;
+        }
+        if (key.hash == 0)
+            key.hash = 1;
+        return key;
+    }
+
+    static bool cacheMatches(const CacheEntry &e, const PathKey &key)
+    {
+        return e.hash == key.hash && e.check == key.check && e.length == key.length;
+    }
+
+    static CacheEntry *cacheFind(const String &path, uint8_t kind)
+    {
+        if (cache.buffer == nullptr)
+            return nullptr;
+        PathKey key = pathKey(path);
+        for (uint8_t i = 0; i < BUZZER_CACHE_FILES; i++)
+        {
+            CacheEntry &e = cache.entries[i];
+            if (cacheMatches(e, key) && e.kind == kind && !e.pending)
+            {
+                e.lastUse = ++cache.clock;
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+
+    // Frees the least recently used entry that is not being played or filled
+    static bool cacheEvict()
+    {
+        CacheEntry *victim = nullptr;
+        for (uint8_t i = 0; i < BUZZER_CACHE_FILES; i++)
+        {
+            CacheEntry &e = cache.entries[i];
+            if (e.hash == 0 || e.pending || Channels::uses(cache.buffer + e.offset, cache.buffer + e.offset + e.size))
+                continue;
+            if (victim == nullptr || (int16_t)(e.lastUse - victim->lastUse) < 0)
+                victim = &e;
+        }
+        if (victim == nullptr)
+            return false;
+        victim->hash = 0;
+        return true;
+    }
+
+    // Claims room for size bytes of records, replacing an older copy of the same file
+    static int8_t cacheReserve(const String &path, uint8_t kind, uint16_t size)
+    {
+        if (cache.buffer == nullptr || size == 0 || size > cache.size)
+            return -1;
+        PathKey key = pathKey(path);
+        for (uint8_t i = 0; i < BUZZER_CACHE_FILES; i++)
+        {
+            CacheEntry &e = cache.entries[i];
+            if (cacheMatches(e, key) && e.kind == kind && !e.pending && !Channels::uses(cache.buffer + e.offset, cache.buffer + e.offset + e.size))
+                e.hash = 0;
+        }
+        int8_t slot = -1;
+        int32_t offset = -1;
+        while (true)
+        {
+            for (uint8_t i = 0; i < BUZZER_CACHE_FILES && slot < 0; i++)
+                if (cache.entries[i].hash == 0)
+                    slot = i;
+            uint16_t length;
+            if (slot >= 0 && (offset = findGap(cache.entries, cache.size, size, length)) >= 0)
+                break;
+            slot = -1;
+            if (!cacheEvict())
+                return -1;
+        }
+        CacheEntry &e = cache.entries[slot];
+        e.hash = key.hash;
+        e.check = key.check;
+        e.length = key.length;
+        e.offset = (uint16_t)offset;
+        e.size = size;
+        e.lastUse = ++cache.clock;
+        e.kind = kind;
+        e.count = 0;
+        e.pending = true;
+        return slot;
+    }
+
+    static void cacheCommit(int8_t slot, uint8_t count, uint16_t recordSize)
+    {
+        CacheEntry &e = cache.entries[slot];
+        e.count = count;
+        e.size = count * recordSize;
+        e.pending = false;
+        if (count == 0)
+            e.hash = 0;
+    }
+
+    static void cacheStore(const String &path, uint8_t kind, const void *records, uint8_t count, uint16_t recordSize)
+    {
+        int8_t slot = cacheReserve(path, kind, count * recordSize);
+        if (slot < 0)
+            return;
+        memcpy(cache.buffer + cache.entries[slot].offset, records, count * recordSize);
+        cacheCommit(slot, count, recordSize);
+    }
+
+    // Copies a cached file into the caller's array, returns false on a miss
+    static bool cacheLoad(const String &path, uint8_t kind, void *records, uint8_t maxCount, uint16_t recordSize, uint8_t &count)
+    {
+        const CacheEntry *e = cacheFind(path, kind);
+        if (e == nullptr)
+            return false;
+        count = e->count > maxCount ? maxCount : e->count;
+        memcpy(records, cache.buffer + e->offset, count * recordSize);
+        return true;
+    }
+#endif
+
+    void setCache(void *buffer, uint16_t size)
+    {
+        BUZ_TASK_CALL_VOID(setCache(buffer, size));
+#ifdef BUZZER_USE_SD
+        streamState.cacheSlot = -1; // A playFile() filling an entry keeps streaming, just uncached
+        if (cache.buffer != nullptr)
+            Channels::stopUsing(cache.buffer, cache.buffer + cache.size); // Cache hits play from the old buffer
+        memset(&cache, 0, sizeof(cache));
+        alignBuffer(buffer, size, cache.buffer, cache.size);
+#else
+        (void)buffer;
+        (void)size;
+#endif
+    }
+
+    void uncache(const String &path)
+    {
+        BUZ_TASK_CALL_VOID(uncache(path));
+#ifdef BUZZER_USE_SD
+        PathKey key = pathKey(path);
+        for (uint8_t i = 0; i < BUZZER_CACHE_FILES; i++)
+        {
+            CacheEntry &e = cache.entries[i];
+            if (cacheMatches(e, key) && !e.pending && !Channels::uses(cache.buffer + e.offset, cache.buffer + e.offset + e.size))
+                e.hash = 0;
+        }
+#else
+        (void)path;
+#endif
+    }
+
+    void clearCache()
+    {
+        BUZ_TASK_CALL_VOID(clearCache());
+#ifdef BUZZER_USE_SD
+        for (uint8_t i = 0; i < BUZZER_CACHE_FILES; i++)
+        {
+            CacheEntry &e = cache.entries[i];
+            if (!e.pending && !Channels::uses(cache.buffer + e.offset, cache.buffer + e.offset + e.size))
+                e.hash = 0;
+        }
+#endif
+    }
+
+#ifdef BUZZER_USE_SD
+    // Parses count unsigned integers separated by blanks or a comma, in place and without allocating.
+    // Only blanks or a # comment may follow; returns false if the line is malformed or a value exceeds 65535
+    static bool parseNumbers(const char *line, uint16_t *values, uint8_t count)
+    {
+        for (uint8_t i = 0; i < count; i++)
+        {
+            while (*line == ' ' || *line == '\t')
+                ++line;
+            if (i && *line == ',')
+                ++line;
+            while (*line == ' ' || *line == '\t')
+                ++line;
+            if (*line < '0' || *line > '9')
+                return false;
+            uint32_t value = 0;
+            while (*line >= '0' && *line <= '9')
+            {
+                value = value * 10 + (*line++ - '0');
+                if (value > 0xFFFF)
+                    return false;
+            }
+            values[i] = (uint16_t)value;
+        }
+        if (*line == ',')
+            ++line;
+        while (*line == ' ' || *line == '\t')
+            ++line;
+        return *line == '\0' || *line == '#';
+    }
+
+    // Sound file kind named by a text file's first line, 0 if it is not a sound file
+    static uint8_t headerKind(const char *line)
+    {
+        if (strcmp(line, "# play") == 0)
+            return BUZ_FILE_TONES;
+        if (strcmp(line, "# pattern") == 0)
+            return BUZ_FILE_PULSES;
+        return 0;
+    }
+
+    // Parses a tone (frequency, duration, rest) or pulse (count, frequency, duration, interval) line, reporting bad ones
+    static bool parseRecord(const LineReader &r, const char *line, uint8_t kind, uint16_t *values, uint8_t flags)
+    {
+        bool valid = !r.truncated && parseNumbers(line, values, kind == BUZ_FILE_TONES ? 3 : 4) && (kind == BUZ_FILE_TONES || values[0] <= 255);
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!valid && !(flags & BUZ_SILENT))
+        {
+            SERIAL.print(F(BUZ_LOG_PREFIX ANSI_ERROR "Skipped malformed line " ANSI_YELLOW));
+            SERIAL.println(r.linenum);
+            SERIAL.print(F(ANSI_DEFAULT));
+        }
+#endif
+        return valid;
+    }
+
+    // Sound files store milliseconds, the engines use BUZ_MS() units
+    static uint16_t fileTime(uint16_t ms)
+    {
+#ifdef BUZZER_TIMEBASE_US
+        uint32_t units = (uint32_t)ms * 1000UL / BUZZER_TIMEBASE_US;
+        return units > 0xFFFF ? 0xFFFF : (uint16_t)units;
+#else
+        return ms;
+#endif
+    }
+
+    static void closeStream()
+    {
+        if (streamState.cacheSlot >= 0 && cache.entries[streamState.cacheSlot].pending)
+            cache.entries[streamState.cacheSlot].hash = 0; // Abandoned before the end of the file
+        streamState.cacheSlot = -1;
+        if (streamState.file)
+            streamState.file.close();
+        streamState.head = streamState.tail;
+        streamState.eof = true;
+    }
+
+    // Parses a line into the ring buffer, returns false if the file is not a play file
+    static bool streamLine(char *line)
+    {
+        ToneStream &s = streamState;
+        if (s.reader.linenum == 1)
+        {
+            if (headerKind(line) != BUZ_FILE_TONES)
+            {
+#ifndef BUZZER_SERIAL_DISABLE
+                if (!(s.flags & BUZ_SILENT))
+                    SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid play file!" ANSI_DEFAULT));
+#endif
+                return false;
+            }
+            return true;
+        }
+        if (*line == '\0' || *line == '#')
+            return true;
+
+        uint16_t v[3];
+        if (parseRecord(s.reader, line, BUZ_FILE_TONES, v, s.flags))
+        {
+            Tone tone(v[0], fileTime(v[1]), fileTime(v[2]));
+            s.ring[s.tail % BUZZER_STREAM_TONES] = tone;
+            BUZ_BARRIER();
+            s.tail++;
+            if (s.cacheSlot >= 0)
+            {
+                CacheEntry &e = cache.entries[s.cacheSlot];
+                if ((uint16_t)(s.cached + 1) * sizeof(Tone) <= e.size)
+                    memcpy(cache.buffer + e.offset + s.cached++ * sizeof(Tone), &tone, sizeof(Tone));
+                else
+                {
+                    e.hash = 0; // Longer than the reserved room, keep streaming it
+                    s.cacheSlot = -1;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Tops up the ring buffer once it is half empty, reading at most one chunk per call
+    static bool refillStream()
+    {
+        ToneStream &s = streamState;
+        if (s.eof || streamCount() > BUZZER_STREAM_TONES / 2)
+            return true;
+        uint8_t reads = 1;
+        while (streamCount() < BUZZER_STREAM_TONES)
+        {
+            char *line;
+            uint8_t result = readLine(s.file, s.reader, reads, line);
+            if (result == BUZ_LINE_WAIT)
+                return true;
+            if (result == BUZ_LINE_END)
+            {
+                if (s.cacheSlot >= 0)
+                {
+                    cacheCommit(s.cacheSlot, s.cached, sizeof(Tone));
+                    s.cacheSlot = -1;
+                }
+                s.file.close();
+                s.eof = true;
+                return true;
+            }
+            if (!streamLine(line))
+            {
+                closeStream();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static uint16_t recordSize(uint8_t kind)
+    {
+        return kind == BUZ_FILE_TONES ? sizeof(Tone) : sizeof(Pulse);
+    }
+
+    static uint8_t recordLimit(uint8_t kind, uint16_t capacity)
+    {
+        uint16_t limit = capacity / recordSize(kind);
+        return limit > 255 ? 255 : (uint8_t)limit;
+    }
+
+    // Loads a binary sound file, returns false if path is not a binary file so the caller can parse it as text
+    static bool loadBinary(const String &path, uint8_t &kind, void *records, uint16_t capacity, uint8_t &count, uint8_t flags)
+    {
+        count = 0;
+        File file = SD.open(path.c_str(), FILE_READ);
+        if (!file)
+            return false;
+        FileHeader header;
+        if (file.read((uint8_t *)&header, sizeof(header)) != (int)sizeof(header) || header.magic != BUZ_FILE_MAGIC)
+        {
+            file.close();
+            return false;
+        }
+        if (header.version != BUZ_FILE_VERSION || (header.kind != BUZ_FILE_TONES && header.kind != BUZ_FILE_PULSES) || (kind && header.kind != kind))
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Unsupported binary sound file!" ANSI_DEFAULT));
+#endif
+            file.close();
+            return true;
+        }
+        kind = header.kind;
+        uint8_t maxCount = recordLimit(kind, capacity);
+        uint8_t wanted = header.count > maxCount ? maxCount : (uint8_t)header.count;
+        if (kind == BUZ_FILE_TONES)
+        {
+            count = file.read((uint8_t *)records, wanted * BUZ_FILE_TONE_SIZE) / BUZ_FILE_TONE_SIZE;
+#ifdef BUZZER_TIMEBASE_US
+            Tone *tones = (Tone *)records;
+            for (uint8_t i = 0; i < count; i++)
+                tones[i] = Tone(tones[i].frequency, fileTime(tones[i].duration), fileTime(tones[i].rest));
+#endif
+        }
+        else
+        {
+            // Read the packed records into the tail of the array, then widen them in place front to back
+            Pulse *pulses = (Pulse *)records;
+            uint8_t *packed = (uint8_t *)records + (size_t)wanted * (sizeof(Pulse) - BUZ_FILE_PULSE_SIZE);
+            count = file.read(packed, wanted * BUZ_FILE_PULSE_SIZE) / BUZ_FILE_PULSE_SIZE;
+            for (uint8_t i = 0; i < count; i++, packed += BUZ_FILE_PULSE_SIZE)
+            {
+                uint8_t pulseCnt = packed[0];
+                uint16_t freq = packed[1] | (packed[2] << 8);
+                uint16_t dur = packed[3] | (packed[4] << 8);
+                uint16_t interval = packed[5] | (packed[6] << 8);
+                pulses[i] = Pulse(pulseCnt, freq, fileTime(dur), fileTime(interval), 0, false);
+            }
+        }
+        file.close();
+        return true;
+    }
+
+    static void putWord(uint8_t *record, uint16_t value)
+    {
+        record[0] = value & 0xFF;
+        record[1] = value >> 8;
+    }
+
+    // Reads a text sound file and writes its records to target if it is open, returns false if the file is invalid
+    static bool convertPass(const String &source, File &target, uint8_t &kind, uint16_t &count, uint8_t flags)
+    {
+        count = 0;
+        kind = 0;
+        File file = SD.open(source.c_str(), FILE_READ);
+        if (!file)
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Cannot open sound file!" ANSI_DEFAULT));
+#endif
+            return false;
+        }
+        LineReader reader;
+        char *line;
+        while (nextLine(file, reader, line))
+        {
+            if (reader.linenum == 1)
+            {
+                kind = headerKind(line);
+                if (kind == 0)
+                {
+#ifndef BUZZER_SERIAL_DISABLE
+                    if (!(flags & BUZ_SILENT))
+                        SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid sound file format!" ANSI_DEFAULT));
+#endif
+                    break;
+                }
+                continue;
+            }
+            uint16_t v[4];
+            if (*line == '\0' || *line == '#' || !parseRecord(reader, line, kind, v, flags))
+                continue;
+            uint8_t record[BUZ_FILE_PULSE_SIZE];
+            uint8_t size;
+            if (kind == BUZ_FILE_TONES)
+            {
+                putWord(record, v[0]);
+                putWord(record + 2, v[1]);
+                putWord(record + 4, v[2]);
+                size = BUZ_FILE_TONE_SIZE;
+            }
+            else
+            {
+                record[0] = (uint8_t)v[0];
+                putWord(record + 1, v[1]);
+                putWord(record + 3, v[2]);
+                putWord(record + 5, v[3]);
+                size = BUZ_FILE_PULSE_SIZE;
+            }
+            if (target)
+                target.write(record, size);
+            count++;
+        }
+        file.close();
+        return kind != 0;
+    }
+
+    // Parses a text sound file, kind 0 accepts either format; returns false if the file is missing or invalid
+    static bool loadText(const String &path, uint8_t &kind, void *records, uint16_t capacity, uint8_t &count, uint8_t flags)
+    {
+        count = 0;
+        File file = SD.open(path.c_str(), FILE_READ);
+        if (!file)
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Cannot open sound file!" ANSI_DEFAULT));
+#endif
+            return false;
+        }
+        LineReader reader;
+        uint8_t maxCount = 0;
+        bool valid = true;
+        while (valid)
+        {
+            char *line;
+            if (!nextLine(file, reader, line))
+                break;
+            if (reader.linenum == 1)
+            {
+                uint8_t found = headerKind(line);
+                valid = found && (!kind || found == kind);
+#ifndef BUZZER_SERIAL_DISABLE
+                if (!valid && !(flags & BUZ_SILENT))
+                {
+                    if (kind == BUZ_FILE_TONES)
+                        SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid tone file format!" ANSI_DEFAULT));
+                    else if (kind == BUZ_FILE_PULSES)
+                        SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid pattern file format!" ANSI_DEFAULT));
+                    else
+                        SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid sound file format!" ANSI_DEFAULT));
+                }
+#endif
+                kind = found;
+                maxCount = recordLimit(kind, capacity);
+                continue;
+            }
+            if (*line == '\0' || *line == '#')
+                continue;
+            if (count >= maxCount)
+                break;
+
+            uint16_t v[4];
+            if (!parseRecord(reader, line, kind, v, flags))
+                continue;
+            if (kind == BUZ_FILE_TONES)
+                ((Tone *)records)[count++] = Tone(v[0], fileTime(v[1]), fileTime(v[2]));
+            else
+                ((Pulse *)records)[count++] = Pulse((uint8_t)v[0], v[1], fileTime(v[2]), fileTime(v[3]), 0, false);
+        }
+        file.close();
+        if (!valid)
+            count = 0;
+        return valid;
+    }
+
+    // Loads a binary or text sound file into records
+    static bool loadFile(const String &path, uint8_t &kind, void *records, uint16_t capacity, uint8_t &count, uint8_t flags)
+    {
+        return loadBinary(path, kind, records, capacity, count, flags) || loadText(path, kind, records, capacity, count, flags);
+    }
+
+    static void printLoaded(uint8_t count, uint8_t kind, const String &path, uint8_t flags)
+    {
+#ifndef BUZZER_SERIAL_DISABLE
+        if (flags & BUZ_SILENT)
+            return;
+        SERIAL.print(F(BUZ_LOG_PREFIX "Loaded "));
+        SERIAL.print(count);
+        SERIAL.print(kind == BUZ_FILE_TONES ? F(" tones from ") : F(" pulses from "));
+        SERIAL.println(path);
+#endif
+    }
+
+    // Fills a caller array of maxCount records, going through the file cache
+    static uint8_t loadArray(const String &path, uint8_t kind, void *records, uint8_t maxCount, uint8_t flags)
+    {
+        if (records == nullptr)
+            return 0;
+        uint8_t count;
+        bool cached = cacheLoad(path, kind, records, maxCount, recordSize(kind), count);
+        if (!cached && !loadFile(path, kind, records, maxCount * recordSize(kind), count, flags))
+            return 0;
+        if (!cached && count)
+            cacheStore(path, kind, records, count, recordSize(kind));
+        if (count)
+            printLoaded(count, kind, path, flags);
+        return count;
+    }
+#endif
+
+    uint8_t loadPattern(const String &path, Pulse *pulses, uint8_t flags)
+    {
+        BUZ_TASK_CALL(uint8_t, loadPattern(path, pulses, flags));
+#ifdef BUZZER_USE_SD
+        return loadArray(path, BUZ_FILE_PULSES, pulses, BUZZER_MAX_PATTERN_PULSES, flags);
+#else
+        (void)path;
+        (void)pulses;
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+            SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "SD card support not enabled!" ANSI_DEFAULT));
+#endif
+        return 0;
+#endif
+    }
+
+    uint8_t loadTones(const String &path, Tone *tones, uint8_t flags)
+    {
+        BUZ_TASK_CALL(uint8_t, loadTones(path, tones, flags));
+#ifdef BUZZER_USE_SD
+        return loadArray(path, BUZ_FILE_TONES, tones, BUZZER_MAX_MELODY_TONES, flags);
+#else
+        (void)path;
+        (void)tones;
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+            SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "SD card support not enabled!" ANSI_DEFAULT));
+#endif
+        return 0;
+#endif
+    }
+
+    uint16_t loadProgram(const String &path, uint8_t *code, uint16_t capacity, uint8_t flags)
+    {
+        BUZ_TASK_CALL(uint16_t, loadProgram(path, code, capacity, flags));
+#ifdef BUZZER_USE_SD
+        if (code == nullptr)
+            return 0;
+        File file = SD.open(path.c_str(), FILE_READ);
+        if (!file)
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Cannot open sound file!" ANSI_DEFAULT));
+#endif
+            return 0;
+        }
+        FileHeader header;
+        int size = 0;
+        if (file.read((uint8_t *)&header, sizeof(header)) == (int)sizeof(header) && header.magic == BUZ_FILE_MAGIC &&
+            header.version == BUZ_FILE_VERSION && header.kind == BUZ_FILE_PROGRAM)
+            size = file.read(code, header.count > capacity ? capacity : header.count);
+        else
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid program file!" ANSI_DEFAULT));
+#endif
+        }
+        file.close();
+        if (size <= 0)
+            return 0;
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+        {
+            SERIAL.print(F(BUZ_LOG_PREFIX "Loaded "));
+            SERIAL.print(size);
+            SERIAL.print(F(" program bytes from "));
+            SERIAL.println(path);
+        }
+#endif
+        return (uint16_t)size;
+#else
+        (void)path;
+        (void)code;
+        (void)capacity;
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+            SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "SD card support not enabled!" ANSI_DEFAULT));
+#endif
+        return 0;
+#endif
+    }
+
+#ifdef BUZZER_USE_SD
+    // Loaded sounds sized exactly to their files, carved out of one buffer given to setArena()
+    struct ArenaEntry
+    {
+        uint16_t offset;    // Byte offset of the records in the arena
+        uint16_t size;      // Bytes used by the records
+        uint8_t kind;       // BUZ_FILE_TONES or BUZ_FILE_PULSES, 0 if the entry is free
+        uint8_t count;      // Records held
+        uint8_t generation; // Bumped on release so stale handles are rejected
+        bool pending;       // Being filled by prefetch(), not yet playable
+        bool used() const { return kind != 0; }
+    };
+
+    struct SoundArena
+    {
+        uint8_t *buffer;
+        uint16_t size;
+        ArenaEntry entries[BUZZER_ARENA_SOUNDS];
+    };
+    static SoundArena arena;
+
+    static ArenaEntry *arenaEntry(SoundHandle handle, bool pending = false)
+    {
+        uint8_t slot = (uint8_t)(handle & 0xFF) - 1;
+        if (slot >= BUZZER_ARENA_SOUNDS)
+            return nullptr;
+        ArenaEntry &e = arena.entries[slot];
+        return e.used() && e.pending == pending && e.generation == (uint8_t)(handle >> 8) ? &e : nullptr;
+    }
+
+    // Claims a free handle and the largest free gap of the arena, -1 if there is none
+    static int8_t arenaReserve(uint16_t &offset, uint16_t &length, uint8_t flags)
+    {
+        int8_t slot = -1;
+        for (uint8_t i = 0; i < BUZZER_ARENA_SOUNDS && slot < 0; i++)
+            if (!arena.entries[i].used())
+                slot = i;
+        length = 0;
+        int32_t start = slot < 0 || arena.buffer == nullptr ? -1 : findGap(arena.entries, arena.size, 0, length);
+        if (start < 0 || length < sizeof(Tone))
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Sound arena full!" ANSI_DEFAULT));
+#endif
+            return -1;
+        }
+        offset = (uint16_t)start;
+        return slot;
+    }
+
+#ifdef BUZZER_USE_TONE_TABLE
+#define BUZ_ARENA_SRC BUZ_SRC_TABLE
+#define BUZ_ARENA_MELODY BUZ_SOUND_MELODY_T
+#define BUZ_ARENA_PATTERN BUZ_SOUND_PATTERN_T
+
+    static uint16_t arenaRecordSize(uint8_t kind)
+    {
+        return kind == BUZ_FILE_TONES ? sizeof(TableTone) : sizeof(TablePulse);
+    }
+
+#define BUZ_TABLE_NONE 255 // Record field that was never interned
+
+    // Index of value in the table, taking a free entry if it is new, and counts one more use of it
+    static bool intern(uint16_t *values, uint16_t *refs, uint8_t &used, uint8_t size, uint16_t value, uint8_t &index)
+    {
+        uint8_t free = BUZ_TABLE_NONE;
+        for (index = 0; index < used; index++)
+        {
+            if (refs[index] && values[index] == value)
+            {
+                refs[index]++;
+                return true;
+            }
+            if (!refs[index] && free == BUZ_TABLE_NONE)
+                free = index;
+        }
+        if (free == BUZ_TABLE_NONE && used < size)
+            free = used++;
+        index = free;
+        if (free == BUZ_TABLE_NONE)
+            return false;
+        values[index] = value;
+        refs[index] = 1;
+        return true;
+    }
+
+    static bool internFrequency(uint16_t frequency, uint8_t &index)
+    {
+        if (!intern(table.frequencies, table.frequencyRefs, table.frequencyCount, BUZZER_TABLE_FREQUENCIES, frequency, index))
+            return false;
+#ifdef BUZZER_USE_PWM
+        if (table.frequencyRefs[index] == 1)
+            table.settings[index] = Pwm::setting(frequency);
+#endif
+        return true;
+    }
+
+    static bool internTime(uint16_t time, uint8_t &index)
+    {
+        return intern(table.times, table.timeRefs, table.timeCount, BUZZER_TABLE_TIMES, time, index);
+    }
+
+    static void unref(uint16_t *refs, uint8_t index)
+    {
+        if (index != BUZ_TABLE_NONE)
+            refs[index]--;
+    }
+
+    // Drops the table uses of count records, when their sound is released or fails to load
+    static void tableRelease(const uint8_t *records, uint8_t kind, uint8_t count)
+    {
+        for (uint8_t i = 0; i < count; i++)
+        {
+            if (kind == BUZ_FILE_TONES)
+            {
+                const TableTone &r = ((const TableTone *)records)[i];
+                unref(table.frequencyRefs, r.frequency);
+                unref(table.timeRefs, r.duration);
+                unref(table.timeRefs, r.rest);
+            }
+            else
+            {
+                const TablePulse &r = ((const TablePulse *)records)[i];
+                unref(table.frequencyRefs, r.frequency);
+                unref(table.timeRefs, r.duration);
+                unref(table.timeRefs, r.interval);
+            }
+        }
+    }
+
+    static bool tableFull(uint8_t flags)
+    {
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+            SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Tone table full!" ANSI_DEFAULT));
+#endif
+        return false;
+    }
+
+    // Stores record index of an arena sound; the record is taken by value since loadSound() narrows in place
+    static bool arenaStore(uint8_t *records, uint8_t index, Tone tone, uint8_t flags)
+    {
+        TableTone r = {BUZ_TABLE_NONE, BUZ_TABLE_NONE, BUZ_TABLE_NONE};
+        if (!internFrequency(tone.frequency, r.frequency) || !internTime(tone.duration, r.duration) || !internTime(tone.rest, r.rest))
+        {
+            tableRelease((const uint8_t *)&r, BUZ_FILE_TONES, 1); // Uses of the fields interned before the one that did not fit
+            return tableFull(flags);
+        }
+        ((TableTone *)records)[index] = r;
+        return true;
+    }
+
+    static bool arenaStore(uint8_t *records, uint8_t index, Pulse pulse, uint8_t flags)
+    {
+        TablePulse r = {pulse.pulses, BUZ_TABLE_NONE, BUZ_TABLE_NONE, BUZ_TABLE_NONE};
+        if (!internFrequency(pulse.frequency, r.frequency) || !internTime(pulse.duration, r.duration) || !internTime(pulse.interval, r.interval))
+        {
+            tableRelease((const uint8_t *)&r, BUZ_FILE_PULSES, 1);
+            return tableFull(flags);
+        }
+        ((TablePulse *)records)[index] = r;
+        return true;
+    }
+#else
+#define BUZ_ARENA_SRC BUZ_SRC_RAM
+#define BUZ_ARENA_MELODY BUZ_SOUND_MELODY
+#define BUZ_ARENA_PATTERN BUZ_SOUND_PATTERN
+
+    static uint16_t arenaRecordSize(uint8_t kind)
+    {
+        return recordSize(kind);
+    }
+
+    static bool arenaStore(uint8_t *records, uint8_t index, const Tone &tone, uint8_t)
+    {
+        ((Tone *)records)[index] = tone;
+        return true;
+    }
+
+    static bool arenaStore(uint8_t *records, uint8_t index, const Pulse &pulse, uint8_t)
+    {
+        ((Pulse *)records)[index] = pulse;
+        return true;
+    }
+#endif
+
+    static uint8_t arenaLimit(uint8_t kind, uint16_t capacity)
+    {
+        uint16_t limit = capacity / arenaRecordSize(kind);
+        return limit > 255 ? 255 : (uint8_t)limit;
+    }
+
+    static SoundHandle arenaCommit(int8_t slot, uint16_t offset, uint8_t kind, uint8_t count)
+    {
+        ArenaEntry &e = arena.entries[slot];
+        e.offset = offset;
+        e.size = count * arenaRecordSize(kind);
+        e.kind = kind;
+        e.count = count;
+        e.pending = false;
+        return (SoundHandle)((e.generation << 8) | (slot + 1));
+    }
+
+    // Ends the running prefetch, keeping the records decoded so far if the file was valid
+    static void prefetchDone(bool valid)
+    {
+        Prefetch &f = fetch;
+        f.file.close();
+        if (valid && f.count)
+        {
+            ArenaEntry &e = arena.entries[f.slot];
+            arenaCommit(f.slot, e.offset, f.kind, f.count);
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(f.flags & BUZ_SILENT))
+            {
+                SERIAL.print(F(BUZ_LOG_PREFIX "Prefetched "));
+                SERIAL.print(f.count);
+                SERIAL.println(f.kind == BUZ_FILE_TONES ? F(" tones") : F(" pulses"));
+            }
+#endif
+        }
+        else
+        {
+#ifdef BUZZER_USE_TONE_TABLE
+            tableRelease(arena.buffer + arena.entries[f.slot].offset, f.kind, f.count);
+#endif
+            arena.entries[f.slot].kind = 0;
+            arena.entries[f.slot].generation++; // The handle prefetch() returned turns stale
+        }
+        f.slot = -1;
+    }
+
+    // Decodes the next record of the file into the arena, returns false once the file is done
+    static bool prefetchRecord(bool &valid)
+    {
+        Prefetch &f = fetch;
+        uint8_t *records = arena.buffer + arena.entries[f.slot].offset;
+        if (!f.sniffed)
+        {
+            f.sniffed = true;
+            // Sniff the binary header; the bytes of a text file go on to the line reader
+            FileHeader header;
+            int len = f.file.read(f.reader.chunk, sizeof(header));
+            memcpy(&header, f.reader.chunk, sizeof(header));
+            if (len == (int)sizeof(header) && header.magic == BUZ_FILE_MAGIC)
+            {
+                valid = header.version == BUZ_FILE_VERSION && (header.kind == BUZ_FILE_TONES || header.kind == BUZ_FILE_PULSES);
+#ifndef BUZZER_SERIAL_DISABLE
+                if (!valid && !(f.flags & BUZ_SILENT))
+                    SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Unsupported binary sound file!" ANSI_DEFAULT));
+#endif
+                f.binary = true;
+                f.kind = header.kind;
+                f.left = header.count;
+                f.limit = arenaLimit(f.kind, arena.entries[f.slot].size);
+                return valid;
+            }
+            if (len <= 0)
+                return false;
+            f.reader.chunkLen = (uint8_t)len;
+            return true;
+        }
+        if (f.binary)
+        {
+            uint8_t raw[BUZ_FILE_PULSE_SIZE];
+            uint8_t size = f.kind == BUZ_FILE_TONES ? BUZ_FILE_TONE_SIZE : BUZ_FILE_PULSE_SIZE;
+            if (f.left == 0 || f.count >= f.limit || f.file.read(raw, size) != size)
+                return false;
+            f.left--;
+            if (f.kind == BUZ_FILE_TONES)
+                valid = arenaStore(records, f.count, Tone(raw[0] | (raw[1] << 8), fileTime(raw[2] | (raw[3] << 8)), fileTime(raw[4] | (raw[5] << 8))), f.flags);
+            else
+                valid = arenaStore(records, f.count, Pulse(raw[0], raw[1] | (raw[2] << 8), fileTime(raw[3] | (raw[4] << 8)), fileTime(raw[5] | (raw[6] << 8)), 0, false), f.flags);
+            if (valid)
+                f.count++; // Only stored records are counted, prefetchDone() releases exactly those
+            return valid;
+        }
+        char *line;
+        uint8_t reads = 1;
+        uint8_t result = readLine(f.file, f.reader, reads, line);
+        if (result == BUZ_LINE_END)
+            return false;
+        if (result == BUZ_LINE_WAIT)
+            return true;
+        if (f.reader.linenum == 1)
+        {
+            f.kind = headerKind(line);
+            valid = f.kind != 0;
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!valid && !(f.flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid sound file format!" ANSI_DEFAULT));
 #endif
+            f.limit = arenaLimit(f.kind, arena.entries[f.slot].size);
+            return valid;
+        }
+        if (*line == '\0' || *line == '#')
+            return true;
+        if (f.count >= f.limit)
+            return false;
+        uint16_t v[4];
+        if (!parseRecord(f.reader, line, f.kind, v, f.flags))
+            return true;
+        if (f.kind == BUZ_FILE_TONES)
+            valid = arenaStore(records, f.count, Tone(v[0], fileTime(v[1]), fileTime(v[2])), f.flags);
+        else
+            valid = arenaStore(records, f.count, Pulse((uint8_t)v[0], v[1], fileTime(v[2]), fileTime(v[3]), 0, false), f.flags);
+        if (valid)
+            f.count++;
+        return valid;
     }
 
-    uint8_t loadTones(const String &path, Tone *tones, uint8_t flags)
+    // Decodes records of the prefetched file for up to budget microseconds, at least one per call
+    static void servicePrefetch(uint16_t budget)
+    {
+        if (fetch.slot < 0)
+            return;
+        uint32_t began = micros();
+        bool valid = true;
+        do
+        {
+            if (!prefetchRecord(valid))
+            {
+                prefetchDone(valid);
+                return;
+            }
+        } while (micros() - began < budget);
+    }
+#endif
+
+    void setArena(void *buffer, uint16_t size)
     {
+        BUZ_TASK_CALL_VOID(setArena(buffer, size));
 #ifdef BUZZER_USE_SD
-        if (tones == nullptr)
-            return 0;
-        static Tone *staticTones = nullptr;
-        static uint8_t staticToneCount = 0;
-        staticTones = tones;
-        staticToneCount = 0;
-        bool validFile = SDCard::processLines(path, flags, [](const String &line, uint16_t linenum, uint8_t flags) -> bool
-                                              {
-            String trimmedLine = line;
-            trimmedLine.trim();
-            if (linenum == 1) {
-                if (trimmedLine != F("# play")) {
-#ifndef BUZZER_SERIAL_DISABLE
-                    if (!(flags & BUZ_SILENT))
-                        SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid tone file format!" ANSI_DEFAULT));
+        if (fetch.slot >= 0)
+        {
+            fetch.file.close();
+            fetch.slot = -1;
+        }
+        if (arena.buffer != nullptr)
+            Channels::stopUsing(arena.buffer, arena.buffer + arena.size); // Loaded sounds play from the old arena
+        memset(&arena, 0, sizeof(arena));
+#ifdef BUZZER_USE_TONE_TABLE
+        table = ToneTable(); // Every table index lived in the old arena, whose sounds are stopped above
 #endif
-                    return false;
-                }
-                return true;
-            }
-            if (trimmedLine.length() == 0 || trimmedLine.startsWith(F("#")))
-                return true;
-            if (staticToneCount >= BUZZER_MAX_MELODY_TONES)
-                return true;
+        alignBuffer(buffer, size, arena.buffer, arena.size);
+#else
+        (void)buffer;
+        (void)size;
+#endif
+    }
 
-            char buff[20];
-            char *tok[5];
-            trimmedLine.toCharArray(buff, sizeof(buff));
-            split(buff, tok, 3);
-            if (tok[0] != nullptr && tok[1] != nullptr && tok[2] != nullptr)
+    SoundHandle loadSound(const String &path, uint8_t flags)
+    {
+        BUZ_TASK_CALL(SoundHandle, loadSound(path, flags));
+#ifdef BUZZER_USE_SD
+        uint16_t offset;
+        uint16_t length;
+        int8_t slot = arenaReserve(offset, length, flags);
+        if (slot < 0)
+            return BUZ_NO_SOUND;
+        // Parse into the largest free gap, then keep only the bytes the file needed
+        uint8_t kind = 0;
+        uint8_t count;
+        if (!loadFile(path, kind, arena.buffer + offset, length, count, flags) || count == 0)
+            return BUZ_NO_SOUND;
+#ifdef BUZZER_USE_TONE_TABLE
+        // Narrow the records to table indices front to back, each one lands before any record not read yet
+        uint8_t *records = arena.buffer + offset;
+        for (uint8_t i = 0; i < count; i++)
+            if (!(kind == BUZ_FILE_TONES ? arenaStore(records, i, ((const Tone *)records)[i], flags) : arenaStore(records, i, ((const Pulse *)records)[i], flags)))
             {
-                uint16_t freq = (uint16_t)atoi(tok[0]);
-                uint16_t dur = (uint16_t)atoi(tok[1]);
-                uint16_t rest = (uint16_t)atoi(tok[2]);
-
-                staticTones[staticToneCount] = Tone(freq, dur, rest);
-                staticToneCount++;
+                tableRelease(records, kind, i); // The records narrowed so far
+                return BUZ_NO_SOUND;
             }
-            return true; });
-        uint8_t toneCount = staticToneCount;
-        if (!validFile)
-            return 0;
+#endif
+        printLoaded(count, kind, path, flags);
+        return arenaCommit(slot, offset, kind, count);
+#else
+        (void)path;
 #ifndef BUZZER_SERIAL_DISABLE
         if (!(flags & BUZ_SILENT))
+            SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "SD card support not enabled!" ANSI_DEFAULT));
+#endif
+        return BUZ_NO_SOUND;
+#endif
+    }
+
+    // Opens the file now and decodes it from update(), at most budget microseconds per call
+    SoundHandle prefetch(const String &path, uint8_t flags, uint16_t budget)
+    {
+        BUZ_TASK_CALL(SoundHandle, prefetch(path, flags, budget));
+#ifdef BUZZER_USE_SD
+        if (fetch.slot >= 0)
         {
-            SERIAL.print(F(BUZ_LOG_PREFIX "Loaded "));
-            SERIAL.print(toneCount);
-            SERIAL.print(F(" tones from "));
-            SERIAL.println(path);
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Prefetch already running!" ANSI_DEFAULT));
+#endif
+            return BUZ_NO_SOUND;
         }
+        uint16_t offset;
+        uint16_t length;
+        int8_t slot = arenaReserve(offset, length, flags);
+        if (slot < 0)
+            return BUZ_NO_SOUND;
+        Prefetch &f = fetch;
+        f.file = SD.open(path.c_str(), FILE_READ);
+        if (!f.file)
+        {
+#ifndef BUZZER_SERIAL_DISABLE
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Cannot open sound file!" ANSI_DEFAULT));
 #endif
-        return toneCount;
+            return BUZ_NO_SOUND;
+        }
+        // Hold the whole gap until the file is decoded, then shrink the entry to its records
+        ArenaEntry &e = arena.entries[slot];
+        e.offset = offset;
+        e.size = length;
+        e.kind = BUZ_FILE_TONES;
+        e.count = 0;
+        e.pending = true;
+        f.reader = LineReader();
+        f.left = 0;
+        f.budget = budget;
+        f.kind = 0;
+        f.count = 0;
+        f.limit = 0;
+        f.flags = flags;
+        f.binary = false;
+        f.sniffed = false;
+        f.slot = slot;
+        work = true; // update() runs the steps, even with nothing playing
+        return (SoundHandle)((e.generation << 8) | (slot + 1));
 #else
+        (void)path;
+        (void)budget;
 #ifndef BUZZER_SERIAL_DISABLE
         if (!(flags & BUZ_SILENT))
             SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "SD card support not enabled!" ANSI_DEFAULT));
 #endif
+        return BUZ_NO_SOUND;
+#endif
+    }
+
+    bool isPrefetching()
+    {
+#ifdef BUZZER_USE_SD
+        return fetch.slot >= 0;
+#else
+        return false;
+#endif
+    }
+
+    // Sound for post() or chain() that plays a loaded sound, BUZ_SOUND_NONE until the handle is ready
+    Sound loadedSound(SoundHandle handle, uint8_t priority, uint8_t flags, uint16_t pulseDelay)
+    {
+#ifdef BUZZER_USE_SD
+        const ArenaEntry *e = arenaEntry(handle);
+        if (e == nullptr)
+            return Sound();
+        if (e->kind == BUZ_FILE_TONES)
+            return Sound(BUZ_ARENA_MELODY, priority, flags, arena.buffer + e->offset, e->count);
+        return Sound(BUZ_ARENA_PATTERN, priority, flags, arena.buffer + e->offset, e->count, 0, 0, pulseDelay);
+#else
+        (void)handle;
+        (void)priority;
+        (void)flags;
+        (void)pulseDelay;
+        return Sound();
+#endif
+    }
+
+    bool releaseSound(SoundHandle handle)
+    {
+        BUZ_TASK_CALL(bool, releaseSound(handle));
+#ifdef BUZZER_USE_SD
+        if (fetch.slot >= 0 && arenaEntry(handle, true) == &arena.entries[fetch.slot])
+        {
+            prefetchDone(false); // Cancels the prefetch
+            return true;
+        }
+        ArenaEntry *e = arenaEntry(handle);
+        if (e == nullptr || Channels::uses(arena.buffer + e->offset, arena.buffer + e->offset + e->size))
+            return false;
+#ifdef BUZZER_USE_TONE_TABLE
+        tableRelease(arena.buffer + e->offset, e->kind, e->count);
+#endif
+        e->kind = 0;
+        e->generation++;
+        return true;
+#else
+        (void)handle;
+        return false;
+#endif
+    }
+
+    uint8_t soundLength(SoundHandle handle)
+    {
+#ifdef BUZZER_USE_SD
+        const ArenaEntry *e = arenaEntry(handle);
+        return e ? e->count : 0;
+#else
+        (void)handle;
         return 0;
 #endif
     }
 
-    bool playFile(const String &path, uint8_t flags)
+    bool Buzzer::playSound(SoundHandle handle, bool repeat, uint16_t pulseDelay)
+    {
+        BUZ_TASK_CALL(bool, playSound(handle, repeat, pulseDelay));
+#ifdef BUZZER_USE_SD
+        const ArenaEntry *e = arenaEntry(handle);
+        if (e == nullptr || config.pin == 255)
+            return false;
+        if (e->kind == BUZ_FILE_TONES)
+        {
+            stopMelody();
+            startMelody((const Tone *)(arena.buffer + e->offset), e->count, repeat, BUZ_ARENA_SRC, 0);
+        }
+        else
+            startPattern((const Pulse *)(arena.buffer + e->offset), e->count, repeat, pulseDelay, BUZ_ARENA_SRC, 0);
+        return true;
+#else
+        (void)handle;
+        (void)repeat;
+        (void)pulseDelay;
+        return false;
+#endif
+    }
+
+    bool Buzzer::playFile(const String &path, uint8_t flags)
     {
+        BUZ_TASK_CALL(bool, playFile(path, flags));
 #ifdef BUZZER_USE_SD
+        if (config.pin == 255)
+            return false;
+        if (Channels::streamOwner != nullptr)
+            Channels::streamOwner->stopMelody();
+        stopMelody();
+        const CacheEntry *hit = cacheFind(path, BUZ_FILE_TONES);
+        if (hit != nullptr)
+        {
+            startMelody((const Tone *)(cache.buffer + hit->offset), hit->count, false, BUZ_SRC_RAM, 0);
 #ifndef BUZZER_SERIAL_DISABLE
-        if (!(flags & BUZ_SILENT))
-            SERIAL.println();
+            if (!(flags & BUZ_SILENT))
+            {
+                SERIAL.print(F(BUZ_LOG_PREFIX "Playing cached "));
+                SERIAL.println(path);
+            }
 #endif
-        bool result = SDCard::processLines(path, flags, [](const String &line, uint16_t linenum, uint8_t flags) -> bool
-                                           {
-            String trimmedLine = line;
-            trimmedLine.trim();
-            if (linenum == 1) {
-                if (trimmedLine != F("# play")) {
+            return true;
+        }
+        ToneStream &s = streamState;
+        s.file = SD.open(path.c_str(), FILE_READ);
+        if (!s.file)
+        {
 #ifndef BUZZER_SERIAL_DISABLE
-                    if (!(flags & BUZ_SILENT))
-                        SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Invalid play file!" ANSI_DEFAULT));
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Cannot open play file!" ANSI_DEFAULT));
 #endif
-                    return false;
-                }
-                return true;
+            return false;
+        }
+        s.head = 0;
+        s.tail = 0;
+        s.reader = LineReader();
+        s.eof = false;
+        s.flags = flags;
+        s.cached = 0;
+        s.cacheSlot = cacheReserve(path, BUZ_FILE_TONES, BUZZER_MAX_MELODY_TONES * sizeof(Tone));
+        // Prime the buffer so the first tone starts on the next update()
+        while (!s.eof && streamCount() == 0)
+        {
+            if (!refillStream())
+            {
+                closeStream();
+                return false;
             }
-            if (trimmedLine.length() == 0 || trimmedLine.startsWith(F("#")))
-                return true;
+        }
+        {
+            Lock lock;
+            melodyState = Melody(nullptr, 0, 0, true, false, BUZ_SRC_STREAM);
+            wake(BUZ_RUN_MELODY);
+        }
+        Channels::streamOwner = this;
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+        {
+            SERIAL.print(F(BUZ_LOG_PREFIX "Playing "));
+            SERIAL.println(path);
+        }
+#endif
+        return true;
+#else
+        (void)path;
+#ifndef BUZZER_SERIAL_DISABLE
+        if (!(flags & BUZ_SILENT))
+            SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "SD card support not enabled!" ANSI_DEFAULT));
+#endif
+        return false;
+#endif
+    }
 
-            char buff[20];
-            char *tok[5];
-            trimmedLine.toCharArray(buff, sizeof(buff));
-            split(buff, tok, 3);
-            if (tok[0] != nullptr && tok[1] != nullptr && tok[2] != nullptr)
-            {
-                unsigned int freq = (unsigned int)atoi(tok[0]);
-                unsigned int dur = (unsigned int)atoi(tok[1]);
-                unsigned int rest = (unsigned int)atoi(tok[2]);
-                tone(config.pin, freq, dur);
+    bool Buzzer::playFileBlocking(const String &path, uint8_t flags)
+    {
+        if (!playFile(path, flags))
+            return false;
+        while (melodyState.active)
+        {
+            update();
+            waitForDeadline();
+        }
+        return true;
+    }
+
+    uint16_t convertFile(const String &source, const String &target, uint8_t flags)
+    {
+        BUZ_TASK_CALL(uint16_t, convertFile(source, target, flags));
+#ifdef BUZZER_USE_SD
+        // First pass validates the source and counts records so the header can be written up front
+        File output;
+        uint8_t kind;
+        uint16_t count;
+        if (!convertPass(source, output, kind, count, flags) || count == 0)
+            return 0;
+        if (SD.exists(target.c_str()))
+            SD.remove(target.c_str());
+        output = SD.open(target.c_str(), FILE_WRITE);
+        if (!output)
+        {
 #ifndef BUZZER_SERIAL_DISABLE
-                if (!(flags & BUZ_SILENT))
-                {
-                    SERIAL.print(F(ANSI_CURSORUP BUZ_LOG_PREFIX "Playing freq: " ANSI_YELLOW));
-                    SERIAL.print(freq);
-                    SERIAL.print(F(ANSI_DEFAULT " dur: " ANSI_YELLOW));
-                    SERIAL.print(dur);
-                    SERIAL.print(F("/"));
-                    SERIAL.print(rest);
-                    SERIAL.println(F(ANSI_CLEAREOL));
-                }
+            if (!(flags & BUZ_SILENT))
+                SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "Cannot create binary sound file!" ANSI_DEFAULT));
 #endif
-                delay(dur + rest);
-            }
-            return true; });
+            return 0;
+        }
+        FileHeader header(kind, count);
+        uint8_t raw[sizeof(FileHeader)];
+        putWord(raw, header.magic);
+        raw[2] = header.version;
+        raw[3] = header.kind;
+        putWord(raw + 4, header.count);
+        output.write(raw, sizeof(raw));
+        convertPass(source, output, kind, count, flags | BUZ_SILENT);
+        output.close();
 #ifndef BUZZER_SERIAL_DISABLE
         if (!(flags & BUZ_SILENT))
-            SERIAL.println(F(ANSI_CURSORUP BUZ_LOG_PREFIX "Play finished." ANSI_CLEAREOL));
+        {
+            SERIAL.print(F(BUZ_LOG_PREFIX "Converted "));
+            SERIAL.print(count);
+            SERIAL.print(kind == BUZ_FILE_TONES ? F(" tones to ") : F(" pulses to "));
+            SERIAL.println(target);
+        }
 #endif
-        return result;
+        return count;
 #else
+        (void)source;
+        (void)target;
 #ifndef BUZZER_SERIAL_DISABLE
         if (!(flags & BUZ_SILENT))
             SERIAL.println(F(BUZ_LOG_PREFIX ANSI_ERROR "SD card support not enabled!" ANSI_DEFAULT));
 #endif
-        return false;
+        return 0;
+#endif
+    }
+
+    bool setup(Config conf, uint8_t flags) { return primary.setup(conf, flags); }
+    bool setup(uint8_t pin, uint8_t flags) { return primary.setup(pin, flags); }
+    Config getConfig() { return primary.getConfig(); }
+    Config setConfig(Config conf, uint8_t flags) { return primary.setConfig(conf, flags); }
+    void printConfig(const String &message) { primary.printConfig(message); }
+
+    void beep(uint16_t frequency, uint16_t duration) { primary.beep(frequency, duration); }
+    void pulse(uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval) { primary.pulse(count, frequency, duration, interval); }
+    void pulseBlocking(uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval) { primary.pulseBlocking(count, frequency, duration, interval); }
+
+    void pattern(Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay) { primary.pattern(pulses, count, repeat, pulseDelay); }
+    void patternBlocking(Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay) { primary.patternBlocking(pulses, count, repeat, pulseDelay); }
+    void pattern_P(const Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay) { primary.pattern_P(pulses, count, repeat, pulseDelay); }
+    bool isPatternActive() { return primary.isPatternActive(); }
+    void stopPattern() { primary.stopPattern(); }
+
+    void melody(Tone *tones, uint8_t count, bool repeat) { primary.melody(tones, count, repeat); }
+    void melodyBlocking(Tone *tones, uint8_t count, bool repeat) { primary.melodyBlocking(tones, count, repeat); }
+    void melody_P(const Tone *tones, uint8_t count, bool repeat) { primary.melody_P(tones, count, repeat); }
+    void score(const ScoreTone *tones, uint8_t count, bool repeat) { primary.score(tones, count, repeat); }
+    void packedMelody(const uint8_t *data, uint16_t size, bool repeat) { primary.packedMelody(data, size, repeat); }
+    void packedMelody_P(const uint8_t *data, uint16_t size, bool repeat) { primary.packedMelody_P(data, size, repeat); }
+    bool isMelodyActive() { return primary.isMelodyActive(); }
+    void stopMelody() { primary.stopMelody(); }
+
+    void program(const uint8_t *code, uint16_t size) { primary.program(code, size); }
+    void program_P(const uint8_t *code, uint16_t size) { primary.program_P(code, size); }
+    bool isProgramActive() { return primary.isProgramActive(); }
+    void stopProgram() { primary.stopProgram(); }
+
+    void sweep(uint16_t from, uint16_t to, uint16_t duration, uint8_t curve, bool repeat) { primary.sweep(from, to, duration, curve, repeat); }
+    bool isSweepActive() { return primary.isSweepActive(); }
+    void stopSweep() { primary.stopSweep(); }
+
+    bool playFile(const String &path, uint8_t flags) { return primary.playFile(path, flags); }
+    bool playFileBlocking(const String &path, uint8_t flags) { return primary.playFileBlocking(path, flags); }
+
+    bool playSound(SoundHandle handle, bool repeat, uint16_t pulseDelay) { return primary.playSound(handle, repeat, pulseDelay); }
+
+    bool beepFromISR(uint16_t frequency, uint16_t duration) { return primary.beepFromISR(frequency, duration); }
+    bool pulseFromISR(uint8_t count, uint16_t frequency, uint16_t duration, uint16_t interval) { return primary.pulseFromISR(count, frequency, duration, interval); }
+    bool stopFromISR() { return primary.stopFromISR(); }
+
+    bool post(const Sound &sound) { return primary.post(sound); }
+    uint8_t queuedSounds() { return primary.queuedSounds(); }
+    void clearQueue() { primary.clearQueue(); }
+    bool chain(const Sound &sound, void (*finished)(void *context), void *context) { return primary.chain(sound, finished, context); }
+    bool isChained() { return primary.isChained(); }
+    void onToneStart(void (*callback)(void *context, uint16_t frequency, uint16_t duration), void *context) { primary.onToneStart(callback, context); }
+    void onPatternStep(void (*callback)(void *context, uint8_t index), void *context) { primary.onPatternStep(callback, context); }
+    void onFinished(void (*callback)(void *context, uint8_t sound), void *context) { primary.onFinished(callback, context); }
+
+#ifdef BUZZER_USE_TIMER
+#if defined(ARDUINO_ARCH_AVR)
+#if BUZZER_TIMER_AVR == 2
+    static void startTimer()
+    {
+        Lock lock;
+        TCCR2A = _BV(WGM21); // CTC mode
+        TCCR2B = _BV(CS22);  // Prescaler 64
+        OCR2A = F_CPU / 64 / BUZZER_TIMER_HZ - 1;
+        TCNT2 = 0;
+        TIMSK2 |= _BV(OCIE2A);
+    }
+
+    static void stopTimer()
+    {
+        TIMSK2 &= ~_BV(OCIE2A);
+    }
+#else
+    static void startTimer()
+    {
+        Lock lock;
+        TCCR1A = 0;
+        TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10); // CTC mode, prescaler 64
+        OCR1A = F_CPU / 64 / BUZZER_TIMER_HZ - 1;
+        TCNT1 = 0;
+        TIMSK1 |= _BV(OCIE1A);
+    }
+
+    static void stopTimer()
+    {
+        TIMSK1 &= ~_BV(OCIE1A);
+    }
+#endif
+#elif defined(ARDUINO_ARCH_SAMD)
+    // TC3 is free on SAMD21 boards, the core tone() uses TC5
+    static void syncTimer()
+    {
+        while (TC3->COUNT16.STATUS.bit.SYNCBUSY)
+            ;
+    }
+
+    static void startTimer()
+    {
+        GCLK->CLKCTRL.reg = (uint16_t)(GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_ID(GCM_TCC2_TC3));
+        while (GCLK->STATUS.bit.SYNCBUSY)
+            ;
+        TC3->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE;
+        syncTimer();
+        TC3->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_WAVEGEN_MFRQ | TC_CTRLA_PRESCALER_DIV64;
+        syncTimer();
+        TC3->COUNT16.CC[0].reg = (uint16_t)(SystemCoreClock / 64 / BUZZER_TIMER_HZ - 1);
+        syncTimer();
+        TC3->COUNT16.INTENSET.reg = TC_INTENSET_MC0;
+        NVIC_EnableIRQ(TC3_IRQn);
+        TC3->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+        syncTimer();
+    }
+
+    static void stopTimer()
+    {
+        NVIC_DisableIRQ(TC3_IRQn);
+        TC3->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE;
+        syncTimer();
+    }
+#endif
+#endif
+
+#ifdef BUZZER_USE_PWM
+#if defined(ARDUINO_ARCH_AVR)
+#if BUZZER_PWM_AVR == 2
+    // Timer2 fast PWM with OCR2A as TOP, square wave on OC2B; OCR2A and OCR2B are double-buffered
+    static bool pwmAttach(uint8_t pin)
+    {
+        return digitalPinToTimer(pin) == TIMER2B;
+    }
+
+    static void pwmStart(uint16_t frequency)
+    {
+        const PwmSetting &setting = pwmSetting(frequency);
+        pwm.top = setting.top;
+        OCR2A = (uint8_t)setting.top;
+        OCR2B = (uint8_t)((setting.top * pwm.duty) >> 8);
+        if (!pwm.sounding)
+        {
+            TCNT2 = 0;
+            TCCR2A = _BV(COM2B1) | _BV(WGM21) | _BV(WGM20);
+            pwm.sounding = true;
+        }
+        TCCR2B = _BV(WGM22) | setting.prescaler;
+    }
+
+    static void pwmStop()
+    {
+        TCCR2A = 0; // Disconnects OC2B, the pin falls back to its LOW port value
+        TCCR2B = 0;
+        pwm.sounding = false;
+    }
+
+    static void pwmWriteDuty()
+    {
+        OCR2B = (uint8_t)((pwm.top * pwm.duty) >> 8);
+    }
+#else
+    // Timer1 fast PWM with ICR1 as TOP, square wave on OC1A
+    static bool pwmAttach(uint8_t pin)
+    {
+        return digitalPinToTimer(pin) == TIMER1A;
+    }
+
+    static void pwmStart(uint16_t frequency)
+    {
+        const PwmSetting &setting = pwmSetting(frequency);
+        bool restart = !pwm.sounding || (TCCR1B & 0x07) != setting.prescaler;
+        if (!pwm.sounding)
+        {
+            TCCR1A = _BV(COM1A1) | _BV(WGM11);
+            pwm.sounding = true;
+        }
+        // ICR1 is not double-buffered: restart the period only if TCNT1 is already past the new TOP,
+        // so sweeps retuning every few hundred microseconds keep their phase
+        pwm.top = setting.top;
+        ICR1 = (uint16_t)setting.top;
+        OCR1A = (uint16_t)((setting.top * pwm.duty) >> 8);
+        if (restart || TCNT1 > ICR1)
+            TCNT1 = 0;
+        TCCR1B = _BV(WGM13) | _BV(WGM12) | setting.prescaler;
+    }
+
+    static void pwmStop()
+    {
+        TCCR1A = 0; // Disconnects OC1A, the pin falls back to its LOW port value
+        TCCR1B = 0;
+        pwm.sounding = false;
+    }
+
+    static void pwmWriteDuty()
+    {
+        OCR1A = (uint16_t)((pwm.top * pwm.duty) >> 8);
+    }
 #endif
+#elif defined(ARDUINO_ARCH_SAMD)
+    // TCC normal PWM on the pin's waveform output, note changes go through the PERB/CCB buffers
+    static Tcc *pwmTcc;
+    static uint8_t pwmChannel;
+
+    static void syncPwm()
+    {
+        while (pwmTcc->SYNCBUSY.reg & TCC_SYNCBUSY_MASK)
+            ;
+    }
+
+    static bool pwmAttach(uint8_t pin)
+    {
+        const PinDescription &desc = g_APinDescription[pin];
+        if ((desc.ulPinAttribute & PIN_ATTR_PWM) != PIN_ATTR_PWM || GetTCNumber(desc.ulPWMChannel) >= TCC_INST_NUM)
+            return false;
+        pwmTcc = (Tcc *)GetTC(desc.ulPWMChannel);
+        pwmChannel = GetTCChannelNumber(desc.ulPWMChannel);
+        uint16_t clock = GetTCNumber(desc.ulPWMChannel) < 2 ? GCM_TCC0_TCC1 : GCM_TCC2_TC3;
+        GCLK->CLKCTRL.reg = (uint16_t)(GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_ID(clock));
+        while (GCLK->STATUS.bit.SYNCBUSY)
+            ;
+        pwmTcc->CTRLA.reg &= ~TCC_CTRLA_ENABLE;
+        syncPwm();
+        pwmTcc->CTRLA.reg = TCC_CTRLA_PRESCALER_DIV16;
+        pwmTcc->WAVE.reg = TCC_WAVE_WAVEGEN_NPWM;
+        syncPwm();
+        return true;
+    }
+
+    static void pwmStart(uint16_t frequency)
+    {
+        uint32_t top = pwmSetting(frequency).top;
+        if (pwmTcc == TCC2 && top > 0xFFFF)
+            top = 0xFFFF; // TCC2 is 16-bit, TCC0 and TCC1 are 24-bit
+        pwm.top = top;
+        if (pwm.sounding)
+        {
+            pwmTcc->PERB.reg = top;
+            pwmTcc->CCB[pwmChannel].reg = (top * pwm.duty) >> 8;
+            syncPwm();
+            return;
+        }
+        pwmTcc->PER.reg = top;
+        pwmTcc->CC[pwmChannel].reg = (top * pwm.duty) >> 8;
+        syncPwm();
+        pwmTcc->CTRLA.reg |= TCC_CTRLA_ENABLE;
+        syncPwm();
+        const PinDescription &desc = g_APinDescription[pwm.pin];
+        pinPeripheral(pwm.pin, (desc.ulPinAttribute & PIN_ATTR_TIMER) ? PIO_TIMER : PIO_TIMER_ALT);
+        pwm.sounding = true;
+    }
+
+    static void pwmStop()
+    {
+        if (!pwm.sounding)
+            return;
+        pinPeripheral(pwm.pin, PIO_OUTPUT);
+        digitalWrite(pwm.pin, LOW);
+        pwmTcc->CTRLA.reg &= ~TCC_CTRLA_ENABLE;
+        syncPwm();
+        pwm.sounding = false;
+    }
+
+    static void pwmWriteDuty()
+    {
+        pwmTcc->CCB[pwmChannel].reg = (pwm.top * pwm.duty) >> 8;
+        syncPwm();
     }
-}
\ No newline at end of file
+#endif
+#endif
+}
+
+#ifdef BUZZER_USE_TIMER
+#if defined(ARDUINO_ARCH_AVR)
+#if BUZZER_TIMER_AVR == 2
+ISR(TIMER2_COMPA_vect)
+#else
+ISR(TIMER1_COMPA_vect)
+#endif
+{
+    AsyncBuzzer::Channels::step();
+}
+#elif defined(ARDUINO_ARCH_SAMD)
+void TC3_Handler()
+{
+    TC3->COUNT16.INTFLAG.reg = TC_INTFLAG_MC0;
+    AsyncBuzzer::Channels::step();
+}
+#endif
+#endif
+
+#ifdef BUZZER_USE_SYNTH
+ISR(TIMER1_OVF_vect)
+{
+    AsyncBuzzer::Synth::sample();
+}
+#endif
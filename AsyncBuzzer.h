@@ -8,9 +8,17 @@ MIT License */
 #endif
 
 #ifndef BUZZER_NOUSE_SD
-#define BUZZER_USE_SD // Enable SD card support in AsyncBuzzer (requires SDCard library)
+#define BUZZER_USE_SD // Enable SD card support in AsyncBuzzer (requires SDCard library and SD.h)
 #endif
 
+// #define BUZZER_NOUSE_SLEEP // Spin with delay(1) instead of idling the CPU in the blocking functions
+// #define BUZZER_USE_TIMER // Run the sequencer from a hardware timer interrupt instead of update() (AVR, SAMD)
+// #define BUZZER_USE_TASK // Run the sequencer in its own task (ESP32) or on the second core (RP2040) instead of update()
+// #define BUZZER_USE_PWM // Drive a timer output pin directly instead of using tone() (AVR, SAMD)
+// #define BUZZER_USE_SYNTH // Mix several voices into one Timer1 PWM pin from a sample interrupt (AVR)
+// #define BUZZER_USE_STATS // Record update() cost and note start latency for getStats()
+// #define BUZZER_USE_TONE_TABLE // Keep sounds loaded into the setArena() buffer as one-byte indices into a shared tone table
+
 #ifdef SERIAL_OUT_DISABLE
 #define BUZZER_SERIAL_DISABLE // Disable Serial output
 #endif
@@ -24,6 +32,19 @@ MIT License */
 #endif
 #endif
 
+// #define BUZZER_TIMEBASE_US 100 // Run the engines on micros(), durations in units of this many microseconds
+#if defined(BUZZER_TIMEBASE_US) && (BUZZER_TIMEBASE_US + 0) == 0
+#undef BUZZER_TIMEBASE_US
+#define BUZZER_TIMEBASE_US 100
+#endif
+
+// Converts milliseconds to Tone/Pulse duration units:
+#ifdef BUZZER_TIMEBASE_US
+#define BUZ_MS(ms) ((uint16_t)((uint32_t)(ms) * 1000UL / BUZZER_TIMEBASE_US))
+#else
+#define BUZ_MS(ms) (ms)
+#endif
+
 #ifndef BUZZER_PIN
 #define BUZZER_PIN 255 // Pin for buzzer (255 means no pin defined)
 #endif
@@ -48,14 +69,141 @@ MIT License */
 #ifndef BUZZER_MAX_PATTERN_PULSES
 #define BUZZER_MAX_PATTERN_PULSES 20 // Maximum number of pulses in a pattern
 #endif
+#ifndef BUZZER_TIMER_HZ
+#ifdef BUZZER_TIMEBASE_US
+#define BUZZER_TIMER_HZ 10000 // Sequencer interrupt rate with BUZZER_USE_TIMER
+#else
+#define BUZZER_TIMER_HZ 1000 // Sequencer interrupt rate with BUZZER_USE_TIMER
+#endif
+#endif
+#ifndef BUZZER_TASK_CORE
+#define BUZZER_TASK_CORE 0 // ESP32 core the BUZZER_USE_TASK sequencer task is pinned to, loop() runs on core 1
+#endif
+#ifndef BUZZER_TASK_PRIORITY
+#define BUZZER_TASK_PRIORITY 3 // FreeRTOS priority of the BUZZER_USE_TASK sequencer task
+#endif
+#ifndef BUZZER_TASK_STACK
+#define BUZZER_TASK_STACK 4096 // Stack bytes of the BUZZER_USE_TASK sequencer task
+#endif
+#ifndef BUZZER_TIMER_AVR
+#define BUZZER_TIMER_AVR 1 // AVR timer used with BUZZER_USE_TIMER (1 or 2, tone() needs Timer2 on most boards)
+#endif
+#ifndef BUZZER_PWM_AVR
+#define BUZZER_PWM_AVR 1 // AVR timer used with BUZZER_USE_PWM (1: OC1A, 2: OC2B)
+#endif
+#ifndef BUZZER_SYNTH_VOICES
+#define BUZZER_SYNTH_VOICES 3 // Voices mixed by BUZZER_USE_SYNTH, set up buzzers on BUZ_VOICE(0) and up
+#endif
+#ifndef BUZZER_SYNTH_HZ
+#define BUZZER_SYNTH_HZ 31250 // Sample rate of BUZZER_USE_SYNTH, also its PWM carrier frequency
+#endif
+#ifndef BUZZER_SYNTH_PIN
+#define BUZZER_SYNTH_PIN 9 // OC1A pin the voices are mixed onto (9 on the Uno and Nano, 11 on the Mega)
+#endif
+#ifndef BUZZER_STATS_BUCKETS
+#define BUZZER_STATS_BUCKETS 8 // Note start latency histogram buckets of BUZZER_USE_STATS
+#endif
+#ifndef BUZZER_MAX_CHANNELS
+#define BUZZER_MAX_CHANNELS 4 // Maximum number of buzzers serviced by update()
+#endif
+#ifndef BUZZER_QUEUE_SIZE
+#define BUZZER_QUEUE_SIZE 4 // Number of sounds each buzzer can hold waiting in its post() queue
+#endif
+#ifndef BUZZER_MAILBOX_SIZE
+#define BUZZER_MAILBOX_SIZE 8 // Commands that ISRs (or other tasks with BUZZER_USE_TASK) can have pending for update() (power of two)
+#endif
+#ifndef BUZZER_CALL_TIMEOUT
+#define BUZZER_CALL_TIMEOUT 100 // Milliseconds a BUZZER_USE_TASK call waits for room in a full mailbox before it fails
+#endif
+#ifndef BUZZER_STREAM_TONES
+#define BUZZER_STREAM_TONES 8 // Size of the tone ring buffer used by playFile()
+#endif
+#ifndef BUZZER_CACHE_FILES
+#define BUZZER_CACHE_FILES 4 // Decoded sound files kept by setCache() for repeated loads and plays
+#endif
+#ifndef BUZZER_ARENA_SOUNDS
+#define BUZZER_ARENA_SOUNDS 8 // Sounds that can be loaded into the setArena() buffer at once
+#endif
+#ifndef BUZZER_TABLE_FREQUENCIES
+#define BUZZER_TABLE_FREQUENCIES 16 // Distinct frequencies the BUZZER_USE_TONE_TABLE table holds (at most 255)
+#endif
+#ifndef BUZZER_TABLE_TIMES
+#define BUZZER_TABLE_TIMES 16 // Distinct durations, rests and intervals the BUZZER_USE_TONE_TABLE table holds (at most 255)
+#endif
+#ifndef BUZZER_PREFETCH_US
+#define BUZZER_PREFETCH_US 500 // Default microseconds per update() that prefetch() spends reading its file
+#endif
+#ifndef BUZZER_RAMP_STEP
+#define BUZZER_RAMP_STEP 10 // Milliseconds between frequency updates during a program RAMP
+#endif
+#ifndef BUZZER_PROGRAM_OPS
+#define BUZZER_PROGRAM_OPS 8 // Untimed program ops run per update() before the rest waits for the next call
+#endif
+#ifndef BUZZER_SWEEP_STEP_US
+#define BUZZER_SWEEP_STEP_US 500 // Microseconds between frequency steps of a sweep(), at least one update() or timer tick
+#endif
+#ifndef BUZZER_ENVELOPE_STEPS
+#define BUZZER_ENVELOPE_STEPS 16 // Table steps of the setEnvelope() attack and decay with BUZZER_USE_PWM
+#endif
+#ifndef BUZZER_STREAM_CHUNK
+#define BUZZER_STREAM_CHUNK 32 // Bytes read from the file per refill step in playFile()
+#endif
 
 // Flags:
 #define BUZ_NONE 0x00
 #define BUZ_BEEP 0x01
 #define BUZ_PULSE 0x02
 #define BUZ_FORCE 0x08
+#define BUZ_RESUME 0x10 // Posted sound resumes where it stopped after being preempted
+#define BUZ_REPEAT 0x20 // Posted pattern or melody repeats
 #define BUZ_SILENT 0x80
 
+// Sweep curves:
+#define BUZ_CURVE_LINEAR 0    // Frequency changes by the same number of Hz per step
+#define BUZ_CURVE_EXP 1       // Pitch changes by the same interval per step, sounds even to the ear
+#define BUZ_CURVE_BOUNCE 0x80 // Added to a curve: sweeps to the end frequency and back in the same time
+
+#define BUZ_VOICE(n) (240 + (n)) // Pin number of a BUZZER_USE_SYNTH voice
+
+#define BUZ_DEFAULT 0xFFFF // Use the configured ack setting for this argument
+#define BUZ_NO_SOUND 0     // Handle returned when loadSound() fails
+
+// Melody tone sources:
+#define BUZ_SRC_RAM 0    // Tones read from a RAM array
+#define BUZ_SRC_STREAM 1 // Tones streamed from a file by playFile()
+#define BUZ_SRC_PROGMEM 2 // Tones or pulses read from flash (PROGMEM)
+#define BUZ_SRC_SCORE 3   // ScoreTones read from flash, built with BUZ_SCORE()
+#define BUZ_SRC_PACKED 4  // Packed melody decoded from RAM one note at a time
+#define BUZ_SRC_PACKED_P 5 // Packed melody decoded from flash, built with BUZ_PACKED()
+#define BUZ_SRC_TABLE 6    // Tones or pulses held as tone table indices in the arena
+
+// Sound types for post():
+#define BUZ_SOUND_NONE 0
+#define BUZ_SOUND_BEEP 1      // Single beep: frequency, duration
+#define BUZ_SOUND_PULSE 2     // Pulse group: count, frequency, duration, interval
+#define BUZ_SOUND_PATTERN 3   // Pattern: data (Pulse array), count, interval (pulse delay)
+#define BUZ_SOUND_PATTERN_P 4 // Pattern from a PROGMEM Pulse array
+#define BUZ_SOUND_MELODY 5    // Melody: data (Tone array), count
+#define BUZ_SOUND_MELODY_P 6  // Melody from a PROGMEM Tone array
+#define BUZ_SOUND_PATTERN_T 7 // Pattern of tone table records, from loadedSound() with BUZZER_USE_TONE_TABLE
+#define BUZ_SOUND_MELODY_T 8  // Melody of tone table records, from loadedSound() with BUZZER_USE_TONE_TABLE
+
+// Sounds reported to onFinished():
+#define BUZ_FINISHED_PULSE 1   // Beep or pulse group
+#define BUZ_FINISHED_PATTERN 2 // Pattern, after the delay of its last pulse group
+#define BUZ_FINISHED_MELODY 3  // Melody, file or packed melody, after the rest of its last tone
+#define BUZ_FINISHED_PROGRAM 4 // Sound program reached END
+#define BUZ_FINISHED_SWEEP 5   // Sweep reached its end frequency
+
+// Binary sound files:
+#define BUZ_FILE_MAGIC 0x5A42    // "BZ" as the first two bytes of the file
+#define BUZ_FILE_VERSION 1       // Current binary format version
+#define BUZ_FILE_TONES 1         // File holds Tone records
+#define BUZ_FILE_PULSES 2        // File holds Pulse records
+#define BUZ_FILE_PROGRAM 3       // File holds a sound program, count is its size in bytes
+#define BUZ_FILE_TONE_SIZE 6     // Bytes per Tone record: frequency, duration, rest
+#define BUZ_FILE_PULSE_SIZE 7    // Bytes per Pulse record: pulses, frequency, duration, interval
+
 // Define ANSI color codes if not already defined:
 #ifndef ANSI_GRAY
 #define ANSI_GRAY ""
@@ -78,22 +226,33 @@ MIT License */
 
 namespace AsyncBuzzer
 {
+    typedef uint16_t SoundHandle; // Sound loaded into the arena by loadSound()
+
     struct Tone
     {
         uint16_t frequency;
         uint16_t duration;
         uint16_t rest;
-        Tone(uint16_t f = 0, uint16_t d = 0, uint16_t r = BUZZER_PULSE_INTERVAL) : frequency(f), duration(d), rest(r) {}
+        constexpr Tone(uint16_t f = 0, uint16_t d = 0, uint16_t r = BUZ_MS(BUZZER_PULSE_INTERVAL)) : frequency(f), duration(d), rest(r) {}
     };
 
+    struct FileHeader
+    {
+        uint16_t magic;   // BUZ_FILE_MAGIC
+        uint8_t version;  // BUZ_FILE_VERSION
+        uint8_t kind;     // BUZ_FILE_TONES or BUZ_FILE_PULSES
+        uint16_t count;   // Number of records following the header
+        FileHeader(uint8_t k = 0, uint16_t c = 0) : magic(BUZ_FILE_MAGIC), version(BUZ_FILE_VERSION), kind(k), count(c) {}
+    }; // All values are little-endian
+
     struct Config
     {
         uint8_t pin;
         Tone ack;
         Tone err;
         Config(uint8_t p = 255,
-               Tone a = Tone(BUZZER_ACK_FREQ, BUZZER_ACK_DURATION, BUZZER_PULSE_INTERVAL),
-               Tone e = Tone(BUZZER_ERR_FREQ, BUZZER_ERR_DURATION, BUZZER_PULSE_INTERVAL)) : pin(p), ack(a), err(e) {}
+               Tone a = Tone(BUZZER_ACK_FREQ, BUZ_MS(BUZZER_ACK_DURATION), BUZ_MS(BUZZER_PULSE_INTERVAL)),
+               Tone e = Tone(BUZZER_ERR_FREQ, BUZ_MS(BUZZER_ERR_DURATION), BUZ_MS(BUZZER_PULSE_INTERVAL))) : pin(p), ack(a), err(e) {}
     };
 
     struct Pulse
@@ -104,12 +263,12 @@ namespace AsyncBuzzer
         uint16_t interval;
         uint32_t last;
         bool active;
-        Pulse(uint8_t p = 0, uint16_t f = 0, uint16_t d = 0, uint16_t i = 0, uint32_t t = 0, bool a = false) : pulses(p), frequency(f), duration(d), interval(i), last(t), active(a) {}
+        constexpr Pulse(uint8_t p = 0, uint16_t f = 0, uint16_t d = 0, uint16_t i = 0, uint32_t t = 0, bool a = false) : pulses(p), frequency(f), duration(d), interval(i), last(t), active(a) {}
     };
 
     struct Pattern
     {
-        Pulse *pulses;
+        const Pulse *pulses;
         uint8_t count;
         uint8_t current;
         bool active;
@@ -117,36 +276,415 @@ namespace AsyncBuzzer
         uint16_t pulseDelay;   // Delay between pulses in milliseconds
         uint32_t lastPulseEnd; // When the last pulse finished
         bool waitingForDelay;  // True when waiting for delay between pulses
-        Pattern(Pulse *p = nullptr, uint8_t c = 0, uint8_t cur = 0, bool a = false, bool r = false, uint16_t pd = 300)
-            : pulses(p), count(c), current(cur), active(a), repeat(r), pulseDelay(pd), lastPulseEnd(0), waitingForDelay(false) {}
+        uint8_t source;        // Where pulses are read from (BUZ_SRC_RAM or BUZ_SRC_PROGMEM)
+        Pattern(const Pulse *p = nullptr, uint8_t c = 0, uint8_t cur = 0, bool a = false, bool r = false, uint16_t pd = BUZ_MS(300), uint8_t s = BUZ_SRC_RAM)
+            : pulses(p), count(c), current(cur), active(a), repeat(r), pulseDelay(pd), lastPulseEnd(0), waitingForDelay(false), source(s) {}
     };
 
     struct Melody
     {
-        Tone *tones;        // Array of tone definitions
+        const Tone *tones;  // Array of tone definitions
         uint8_t count;      // Number of tones in melody
         uint8_t current;    // Current tone index
         bool active;        // Melody active state
         bool repeat;        // Should melody repeat when finished
         uint32_t toneStart; // When current tone started
         bool playingTone;   // True when playing tone, false during rest
-        Melody(Tone *t = nullptr, uint8_t c = 0, uint8_t cur = 0, bool a = false, bool r = false)
-            : tones(t), count(c), current(cur), active(a), repeat(r), toneStart(0), playingTone(false) {}
+        uint8_t source;     // Where tones are read from (BUZ_SRC_*)
+        Melody(const Tone *t = nullptr, uint8_t c = 0, uint8_t cur = 0, bool a = false, bool r = false, uint8_t s = BUZ_SRC_RAM)
+            : tones(t), count(c), current(cur), active(a), repeat(r), toneStart(0), playingTone(false), source(s) {}
+    };
+
+    // Decoder position in a packed melody, the current tone is decoded ahead of playing it
+    struct PackedCursor
+    {
+        uint16_t size;         // Bytes in the packed melody
+        uint16_t pos;          // Offset of the next opcode
+        uint8_t key;           // Key number of the last note (C0 = 0, A4 = 57)
+        uint8_t run;           // Repeats of tone still to play
+        uint8_t depth;         // Open loops
+        uint16_t loopStart[2]; // Offset of each open loop body
+        uint8_t loopsLeft[2];  // Passes each open loop still plays
+        Tone tone;             // Tone being played
+        bool ended;            // END reached, no tone left
+        PackedCursor(uint16_t s = 0) : size(s), pos(0), key(57), run(0), depth(0), loopStart{0, 0}, loopsLeft{0, 0}, tone(), ended(s == 0) {}
+    };
+
+    // Interpreter state of a sound program, see program()
+    struct Program
+    {
+        const uint8_t *code;   // Opcode stream
+        uint16_t size;         // Bytes in code
+        uint16_t pc;           // Offset of the next opcode
+        uint8_t source;        // BUZ_SRC_RAM or BUZ_SRC_PROGMEM
+        bool active;           // Program is running
+        bool timing;           // A TONE, REST or RAMP started at opStart is running
+        bool ramping;          // The running op is a RAMP
+        int16_t offset;        // Added to every TONE and RAMP frequency
+        uint16_t frequency;    // Frequency on the pin, 0 while silent
+        uint16_t rampFrom;     // Frequency the running RAMP started at
+        uint16_t rampTo;       // Frequency the running RAMP ends at
+        uint16_t length;       // Duration of the running op
+        uint32_t opStart;      // When the running op started
+        uint32_t lastRetune;   // When the running RAMP last changed the frequency
+        uint8_t depth;         // Open loops
+        uint16_t loopStart[2]; // Offset of each open loop body
+        uint8_t loopsLeft[2];  // Passes each open loop still plays
+        Program(const uint8_t *c = nullptr, uint16_t s = 0, uint8_t src = BUZ_SRC_RAM)
+            : code(c), size(s), pc(0), source(src), active(c != nullptr && s != 0), timing(false), ramping(false), offset(0), frequency(0),
+              rampFrom(0), rampTo(0), length(0), opStart(0), lastRetune(0), depth(0), loopStart{0, 0}, loopsLeft{0, 0} {}
+    };
+
+    // Frequency sweep state, see sweep()
+    struct Sweep
+    {
+        uint16_t from;      // Start frequency
+        uint16_t to;        // End frequency
+        uint8_t curve;      // BUZ_CURVE_*
+        bool active;        // Sweep is running
+        bool repeat;        // Sweep starts over when it ends
+        uint32_t steps;     // Steps from one end frequency to the other
+        int32_t delta;      // Change per step, in 1/65536 Hz away from from (linear) or 1/2^20 octave (exponential)
+        uint32_t start;     // micros() time the current pass started
+        uint32_t nextStep;  // micros() time of the next step
+        uint16_t frequency; // Frequency on the pin, 0 until the first step
+        Sweep() : from(0), to(0), curve(0), active(false), repeat(false), steps(0), delta(0), start(0), nextStep(0), frequency(0) {}
+    };
+
+    struct Sound
+    {
+        uint8_t type;       // BUZ_SOUND_*
+        uint8_t priority;   // Higher priorities preempt lower ones
+        uint8_t flags;      // BUZ_REPEAT, BUZ_RESUME
+        uint8_t count;      // Pulses, pattern pulses or melody tones
+        uint8_t start;      // Index playback starts at, advanced when a preempted sound is put back
+        const void *data;   // Pulse or Tone array for patterns and melodies
+        uint16_t frequency; // Beep and pulse frequency
+        uint16_t duration;  // Beep and pulse duration
+        uint16_t interval;  // Pulse interval or pattern pulse delay
+        constexpr Sound(uint8_t t = BUZ_SOUND_NONE, uint8_t p = 0, uint8_t fl = BUZ_NONE, const void *d = nullptr, uint8_t c = 0, uint16_t f = 0, uint16_t du = 0, uint16_t i = 0)
+            : type(t), priority(p), flags(fl), count(c), start(0), data(d), frequency(f), duration(du), interval(i) {}
+    };
+
+#ifdef BUZZER_USE_PWM
+    // Timer settings for one frequency, loaded by the PWM backend without any division
+    struct PwmSetting
+    {
+        uint32_t top;      // Counter TOP
+        uint8_t prescaler; // Clock select bits (AVR)
+        constexpr PwmSetting(uint32_t t = 0, uint8_t p = 0) : top(t), prescaler(p) {}
     };
 
+    namespace Pwm
+    {
+#if defined(ARDUINO_ARCH_AVR) && BUZZER_PWM_AVR == 2
+        // Timer2 prescalers 1, 8, 32, 64, 128, 256, 1024 for an 8-bit TOP
+        constexpr uint32_t clock() { return F_CPU; }
+        constexpr uint8_t shift(uint8_t cs) { return cs == 1 ? 3 : (cs == 2 || cs == 6) ? 2 : 1; }
+        constexpr PwmSetting fit(uint32_t ticks, uint8_t cs)
+        {
+            return ticks > 256 && cs < 7 ? fit(ticks >> shift(cs), cs + 1) : PwmSetting(ticks > 256 ? 255 : ticks - 1, cs);
+        }
+#elif defined(ARDUINO_ARCH_AVR)
+        // Timer1 prescalers 1, 8, 64, 256, 1024 for a 16-bit TOP
+        constexpr uint32_t clock() { return F_CPU; }
+        constexpr uint8_t shift(uint8_t cs) { return cs <= 2 ? 3 : 2; }
+        constexpr PwmSetting fit(uint32_t ticks, uint8_t cs)
+        {
+            return ticks > 65536UL && cs < 5 ? fit(ticks >> shift(cs), cs + 1) : PwmSetting(ticks > 65536UL ? 65535 : ticks - 1, cs);
+        }
+#else
+        // TCC clocked at F_CPU / 16 with a 24-bit TOP, limited to 16 bits on TCC2 when loaded
+        constexpr uint32_t clock() { return F_CPU / 16; }
+        constexpr PwmSetting fit(uint32_t ticks, uint8_t)
+        {
+            return PwmSetting(ticks > 0x1000000UL ? 0xFFFFFF : ticks - 1, 0);
+        }
+#endif
+        constexpr PwmSetting setting(uint16_t frequency)
+        {
+            return fit(clock() / (frequency ? frequency : 1), 1);
+        }
+    }
+#endif
+
+    // Never defined as constexpr, so an invalid note name fails to compile inside BUZ_SCORE()
+    uint16_t invalidNoteName();
+
+    namespace Notes
+    {
+        // Octave 8 frequencies in 1/100 Hz, lower octaves are derived by halving
+        constexpr uint32_t octave8(uint8_t semitone)
+        {
+            return semitone == 0 ? 418601 : semitone == 1 ? 443492 : semitone == 2 ? 469864 : semitone == 3 ? 497803 : semitone == 4 ? 527404 : semitone == 5 ? 558765 : semitone == 6 ? 591991 : semitone == 7 ? 627193 : semitone == 8 ? 664488 : semitone == 9 ? 704000 : semitone == 10 ? 745862 : 790213;
+        }
+        constexpr int8_t step(char letter)
+        {
+            return letter == 'C' ? 0 : letter == 'D' ? 2 : letter == 'E' ? 4 : letter == 'F' ? 5 : letter == 'G' ? 7 : letter == 'A' ? 9 : letter == 'B' ? 11 : -100;
+        }
+        constexpr uint16_t key(int16_t k)
+        {
+            return k < 0 || k >= 9 * 12 ? invalidNoteName() : (uint16_t)(((octave8(k % 12) >> (8 - k / 12)) + 50) / 100);
+        }
+        constexpr uint16_t octave(const char *name, uint8_t at, int16_t semitone)
+        {
+            return name[at] < '0' || name[at] > '8' || name[at + 1] != '\0' ? invalidNoteName() : key((name[at] - '0') * 12 + semitone);
+        }
+        constexpr uint8_t number(const char *name, uint8_t at, int16_t semitone)
+        {
+            return name[at] < '0' || name[at] > '8' || name[at + 1] != '\0' || (name[at] - '0') * 12 + semitone < 0 || (name[at] - '0') * 12 + semitone >= 9 * 12
+                       ? (uint8_t)invalidNoteName()
+                       : (uint8_t)((name[at] - '0') * 12 + semitone);
+        }
+    }
+
+    // Frequency of a note name such as "A4", "C#5" or "Eb3" (equal temperament, A4 = 440 Hz), "R" is a rest
+    constexpr uint16_t note(const char *name)
+    {
+        return (name[0] == 'R' || name[0] == '-') && name[1] == '\0' ? 0
+               : name[1] == '#' ? Notes::octave(name, 2, Notes::step(name[0]) + 1)
+               : name[1] == 'b' ? Notes::octave(name, 2, Notes::step(name[0]) - 1)
+                                : Notes::octave(name, 1, Notes::step(name[0]));
+    }
+
+    // Key number of a note name for BUZ_PK_KEY(), C0 = 0 and A4 = 57
+    constexpr uint8_t keyOf(const char *name)
+    {
+        return name[1] == '#' ? Notes::number(name, 2, Notes::step(name[0]) + 1)
+               : name[1] == 'b' ? Notes::number(name, 2, Notes::step(name[0]) - 1)
+                                : Notes::number(name, 1, Notes::step(name[0]));
+    }
+
+    // Never defined as constexpr, so an out of range packed opcode fails to compile inside BUZ_PACKED()
+    uint8_t invalidPackedOp();
+
+    // Packed melody opcode encoders, used through the BUZ_PK_*() macros
+    namespace Packed
+    {
+        constexpr uint8_t lengths(uint8_t count)
+        {
+            return count > 8 ? invalidPackedOp() : count;
+        }
+        constexpr uint8_t note(int8_t delta, uint8_t length)
+        {
+            return delta < -8 || delta > 7 || length > 7 ? invalidPackedOp() : (uint8_t)(0x80 | ((delta + 8) << 3) | length);
+        }
+        constexpr uint8_t rest(uint8_t length)
+        {
+            return length > 7 ? invalidPackedOp() : (uint8_t)(0x20 | length);
+        }
+        constexpr uint8_t repeat(uint8_t times)
+        {
+            return times == 0 || times > 63 ? invalidPackedOp() : (uint8_t)(0x40 | times);
+        }
+        constexpr uint8_t loop(uint8_t passes)
+        {
+            return passes == 0 ? invalidPackedOp() : passes;
+        }
+    }
+
+    // Melody entry with the timer settings for its frequency worked out by the compiler
+    struct ScoreTone
+    {
+        Tone tone;
+#ifdef BUZZER_USE_PWM
+        PwmSetting timer;
+        constexpr ScoreTone(Tone t = Tone()) : tone(t), timer(Pwm::setting(t.frequency)) {}
+#else
+        constexpr ScoreTone(Tone t = Tone()) : tone(t) {}
+#endif
+    };
+
+    // Note lengths at a tempo in beats (quarter notes) per minute
+    struct Tempo
+    {
+        uint16_t bpm;
+        uint8_t legato; // Eighths of each note length that sound, the rest is silence
+        constexpr Tempo(uint16_t b, uint8_t l = 7) : bpm(b), legato(l) {}
+
+        // Milliseconds of a 1/length note, dotted notes last half as long again
+        constexpr uint32_t ms(uint8_t length, bool dotted = false) const
+        {
+            return 240000UL * (dotted ? 3 : 2) / (2UL * bpm * length);
+        }
+        constexpr ScoreTone play(const char *name, uint8_t length, bool dotted = false) const
+        {
+            return ScoreTone(Tone(note(name), BUZ_MS(ms(length, dotted) * legato / 8), BUZ_MS(ms(length, dotted) - ms(length, dotted) * legato / 8)));
+        }
+        constexpr ScoreTone rest(uint8_t length, bool dotted = false) const
+        {
+            return ScoreTone(Tone(0, 0, BUZ_MS(ms(length, dotted))));
+        }
+    };
+
+#ifdef BUZZER_USE_STATS
+    // Counters kept by update() and the sequencers, costs in micros() or in CPU cycles where the DWT counter exists
+    struct Stats
+    {
+        uint32_t updates;                       // update() calls
+        uint32_t minCost;                       // Cheapest update()
+        uint32_t maxCost;                       // Most expensive update()
+        uint32_t totalCost;                     // Sum of all update() costs, the average is totalCost / updates
+        bool cycles;                            // Costs are CPU cycles instead of microseconds
+        uint32_t tones;                         // Tones started by the sequencers
+        uint32_t lastDue;                       // Clock time the last tone was scheduled to start
+        uint32_t lastStart;                     // Clock time the last tone actually started
+        uint32_t maxLatency;                    // Largest lastStart - lastDue, in clock ticks
+        uint16_t latency[BUZZER_STATS_BUCKETS]; // Tone starts late by 0, 1, 2-3, 4-7... time units, the last bucket takes the rest
+
+        Stats() : updates(0), minCost(0xFFFFFFFF), maxCost(0), totalCost(0), cycles(false), tones(0), lastDue(0), lastStart(0), maxLatency(0), latency() {}
+    };
+
+#endif
+    class Buzzer
+    {
+    public:
+#ifdef BUZZER_TIMEBASE_US
+        Buzzer() : queued(0), running(0), pulseSounding(false) {}
+#else
+        Buzzer() : queued(0), running(0) {}
+#endif
+        ~Buzzer();
+
+        bool setup(Config conf, uint8_t flags = BUZ_NONE);
+        bool setup(uint8_t pin = BUZZER_PIN, uint8_t flags = BUZ_NONE);
+        Config getConfig() const;
+        Config setConfig(Config conf, uint8_t flags = BUZ_NONE);
+        void printConfig(const String &message = "");
+
+        void beep(uint16_t frequency = BUZ_DEFAULT, uint16_t duration = BUZ_DEFAULT);
+        void pulse(uint8_t count = 3, uint16_t frequency = BUZ_DEFAULT, uint16_t duration = BUZ_DEFAULT, uint16_t interval = BUZ_DEFAULT);
+        void pulseBlocking(uint8_t count = 3, uint16_t frequency = BUZ_DEFAULT, uint16_t duration = BUZ_DEFAULT, uint16_t interval = BUZ_DEFAULT);
+
+        void pattern(Pulse *pulses, uint8_t count, bool repeat = false, uint16_t pulseDelay = BUZ_MS(300));
+        void patternBlocking(Pulse *pulses, uint8_t count, bool repeat = false, uint16_t pulseDelay = BUZ_MS(300));
+        void pattern_P(const Pulse *pulses, uint8_t count, bool repeat = false, uint16_t pulseDelay = BUZ_MS(300));
+        bool isPatternActive() const;
+        void stopPattern();
+
+        void melody(Tone *tones, uint8_t count, bool repeat = false);
+        void melodyBlocking(Tone *tones, uint8_t count, bool repeat = false);
+        void melody_P(const Tone *tones, uint8_t count, bool repeat = false);
+        void score(const ScoreTone *tones, uint8_t count, bool repeat = false);
+        void packedMelody(const uint8_t *data, uint16_t size, bool repeat = false);
+        void packedMelody_P(const uint8_t *data, uint16_t size, bool repeat = false);
+        bool isMelodyActive() const;
+        void stopMelody();
+
+        void program(const uint8_t *code, uint16_t size);
+        void program_P(const uint8_t *code, uint16_t size);
+        bool isProgramActive() const;
+        void stopProgram();
+
+        void sweep(uint16_t from, uint16_t to, uint16_t duration, uint8_t curve = BUZ_CURVE_EXP, bool repeat = false);
+        bool isSweepActive() const;
+        void stopSweep();
+
+        bool playFile(const String &path, uint8_t flags = BUZ_NONE);
+        bool playFileBlocking(const String &path, uint8_t flags = BUZ_NONE);
+        bool playSound(SoundHandle handle, bool repeat = false, uint16_t pulseDelay = BUZ_MS(300));
+
+        bool beepFromISR(uint16_t frequency = BUZ_DEFAULT, uint16_t duration = BUZ_DEFAULT);
+        bool pulseFromISR(uint8_t count = 3, uint16_t frequency = BUZ_DEFAULT, uint16_t duration = BUZ_DEFAULT, uint16_t interval = BUZ_DEFAULT);
+        bool stopFromISR();
+
+        bool post(const Sound &sound);
+        uint8_t queuedSounds() const;
+        void clearQueue();
+
+        bool chain(const Sound &sound, void (*finished)(void *context) = nullptr, void *context = nullptr);
+        bool isChained() const;
+
+        void onToneStart(void (*callback)(void *context, uint16_t frequency, uint16_t duration), void *context = nullptr);
+        void onPatternStep(void (*callback)(void *context, uint8_t index), void *context = nullptr);
+        void onFinished(void (*callback)(void *context, uint8_t sound), void *context = nullptr);
+
+        bool nextDeadline(uint32_t &deadline) const;
+
+    private:
+        friend struct Channels;
+        Config config;
+        Pulse pulseState;
+        Pattern patternState;
+        Melody melodyState;
+        PackedCursor packedState;
+        Program programState;
+        Sweep sweepState;
+        Sound sound;                    // Posted sound currently playing
+        Sound queue[BUZZER_QUEUE_SIZE]; // Waiting sounds, highest priority first
+        uint8_t queued;                 // Number of sounds in queue
+        uint8_t running;                // BUZ_RUN_* bits of the engines step() has to service, 0 when idle
+        Sound chained;                  // Sound chain() starts the moment the current one ends
+        void (*chainFinished)(void *) = nullptr; // Called as the chained sound takes over
+        void *chainContext = nullptr;            // Passed to chainFinished
+        uint32_t chainAt = 0;                    // Where the chained sound was due to start, 0 once it has
+        bool chainStep = false;                  // A sound was handed off, step() runs the engines once more
+        void (*toneStartCallback)(void *, uint16_t, uint16_t) = nullptr;
+        void *toneStartContext = nullptr;
+        void (*patternStepCallback)(void *, uint8_t) = nullptr;
+        void *patternStepContext = nullptr;
+        void (*finishedCallback)(void *, uint8_t) = nullptr;
+        void *finishedContext = nullptr;
+#ifdef BUZZER_TIMEBASE_US
+        bool pulseSounding; // Pulse tone is on and waits for its explicit noTone()
+#endif
+#ifdef BUZZER_USE_STATS
+        uint32_t toneDue = 0; // Scheduled start of the tone the next step() begins, 0 if none
+#endif
+
+        Buzzer(const Buzzer &) = delete;
+        Buzzer &operator=(const Buzzer &) = delete;
+        Pulse patternPulse(uint8_t index) const;
+        bool advancePattern();
+        bool melodyTone(Tone &out) const;
+        void nextMelodyTone();
+        uint8_t packedByte(uint16_t pos) const;
+        void rewindPacked();
+        void decodePacked();
+        uint8_t programByte(uint16_t pos) const;
+        uint16_t programWord(uint16_t pos) const;
+        void startProgram(const uint8_t *code, uint16_t size, uint8_t source);
+        bool stepProgram(uint32_t now);
+        bool stepSweep();
+        void startPattern(const Pulse *pulses, uint8_t count, bool repeat, uint16_t pulseDelay, uint8_t source, uint8_t start);
+        void startMelody(const Tone *tones, uint8_t count, bool repeat, uint8_t source, uint8_t start);
+        bool enqueue(const Sound &sound, bool front);
+        uint8_t soundPosition() const;
+        void startSound(const Sound &sound);
+        void serviceQueue(uint32_t now);
+        void handOff(uint32_t due);
+        void toneStarted(uint16_t frequency, uint16_t duration);
+        void finished(uint8_t sound);
+        void wake(uint8_t engines);
+        uint8_t runState() const;
+        bool stepEngines(uint32_t now);
+        bool step(uint32_t now);
+    };
+
+    // Namespace functions drive the primary buzzer, update() services every buzzer
     bool setup(Config conf, uint8_t flags = BUZ_NONE);
     bool setup(uint8_t pin = BUZZER_PIN, uint8_t flags = BUZ_NONE);
-    bool update();
+    bool update(uint16_t budget = 0);
+#ifdef BUZZER_USE_TASK
+    void runTask();
+#endif
+    bool nextDeadline(uint32_t &deadline);
     Config getConfig();
     Config setConfig(Config conf, uint8_t flags = BUZ_NONE);
     void printConfig(const String &message = "");
+#ifdef BUZZER_USE_STATS
+    Stats getStats();
+    void printStats(const String &message = "");
+    void resetStats();
+#endif
 
     void beep(uint16_t frequency = getConfig().ack.frequency, uint16_t duration = getConfig().ack.duration);
     void pulse(uint8_t count = 3, uint16_t frequency = getConfig().ack.frequency, uint16_t duration = getConfig().ack.duration, uint16_t interval = getConfig().ack.rest);
     void pulseBlocking(uint8_t count = 3, uint16_t frequency = getConfig().ack.frequency, uint16_t duration = getConfig().ack.duration, uint16_t interval = getConfig().ack.rest);
 
-    void pattern(Pulse *pulses, uint8_t count, bool repeat = false, uint16_t pulseDelay = 300);
-    void patternBlocking(Pulse *pulses, uint8_t count, bool repeat = false, uint16_t pulseDelay = 300);
+    void pattern(Pulse *pulses, uint8_t count, bool repeat = false, uint16_t pulseDelay = BUZ_MS(300));
+    void patternBlocking(Pulse *pulses, uint8_t count, bool repeat = false, uint16_t pulseDelay = BUZ_MS(300));
+    void pattern_P(const Pulse *pulses, uint8_t count, bool repeat = false, uint16_t pulseDelay = BUZ_MS(300));
     bool isPatternActive();
     void stopPattern();
 
@@ -154,9 +692,105 @@ namespace AsyncBuzzer
 
     void melody(Tone *tones, uint8_t count, bool repeat = false);
     void melodyBlocking(Tone *tones, uint8_t count, bool repeat = false);
+    void melody_P(const Tone *tones, uint8_t count, bool repeat = false);
+    void score(const ScoreTone *tones, uint8_t count, bool repeat = false);
+    void packedMelody(const uint8_t *data, uint16_t size, bool repeat = false);
+    void packedMelody_P(const uint8_t *data, uint16_t size, bool repeat = false);
     bool isMelodyActive();
     void stopMelody();
 
     uint8_t loadTones(const String &path, Tone *tones, uint8_t flags = BUZ_NONE);
+
+    void program(const uint8_t *code, uint16_t size);
+    void program_P(const uint8_t *code, uint16_t size);
+    bool isProgramActive();
+    void stopProgram();
+    uint16_t loadProgram(const String &path, uint8_t *code, uint16_t capacity, uint8_t flags = BUZ_NONE);
+
+    void sweep(uint16_t from, uint16_t to, uint16_t duration, uint8_t curve = BUZ_CURVE_EXP, bool repeat = false);
+    bool isSweepActive();
+    void stopSweep();
+
     bool playFile(const String &path, uint8_t flags = BUZ_NONE);
-}
\ No newline at end of file
+    bool playFileBlocking(const String &path, uint8_t flags = BUZ_NONE);
+
+    void setArena(void *buffer, uint16_t size);
+    SoundHandle loadSound(const String &path, uint8_t flags = BUZ_NONE);
+    SoundHandle prefetch(const String &path, uint8_t flags = BUZ_NONE, uint16_t budget = BUZZER_PREFETCH_US);
+    bool isPrefetching();
+    Sound loadedSound(SoundHandle handle, uint8_t priority = 0, uint8_t flags = BUZ_NONE, uint16_t pulseDelay = BUZ_MS(300));
+    bool playSound(SoundHandle handle, bool repeat = false, uint16_t pulseDelay = BUZ_MS(300));
+    uint8_t soundLength(SoundHandle handle);
+    bool releaseSound(SoundHandle handle);
+
+    bool beepFromISR(uint16_t frequency = BUZ_DEFAULT, uint16_t duration = BUZ_DEFAULT);
+    bool pulseFromISR(uint8_t count = 3, uint16_t frequency = BUZ_DEFAULT, uint16_t duration = BUZ_DEFAULT, uint16_t interval = BUZ_DEFAULT);
+    bool stopFromISR();
+
+    bool post(const Sound &sound);
+    uint8_t queuedSounds();
+    void clearQueue();
+    bool chain(const Sound &sound, void (*finished)(void *context) = nullptr, void *context = nullptr);
+    bool isChained();
+    void onToneStart(void (*callback)(void *context, uint16_t frequency, uint16_t duration), void *context = nullptr);
+    void onPatternStep(void (*callback)(void *context, uint8_t index), void *context = nullptr);
+    void onFinished(void (*callback)(void *context, uint8_t sound), void *context = nullptr);
+
+    void setVolume(uint8_t level);
+    void setEnvelope(uint16_t attack, uint16_t decay, uint8_t sustain = 255);
+
+    void setCache(void *buffer, uint16_t size);
+    void uncache(const String &path);
+    void clearCache();
+
+    uint16_t convertFile(const String &source, const String &target, uint8_t flags = BUZ_NONE);
+}
+
+// Number of entries in a BUZ_SCORE() or BUZ_PATTERN() table
+#define BUZ_COUNT(table) ((uint8_t)(sizeof(table) / sizeof((table)[0])))
+
+// Declares a flash-resident score for score(), evaluated entirely at compile time
+#define BUZ_SCORE(name, ...)                                                \
+    constexpr AsyncBuzzer::ScoreTone name[] PROGMEM = {__VA_ARGS__};        \
+    static_assert(sizeof(name) / sizeof(name[0]) <= BUZZER_MAX_MELODY_TONES, \
+                  #name " has more than BUZZER_MAX_MELODY_TONES tones")
+
+// Declares a flash-resident pattern for pattern_P(), evaluated entirely at compile time
+#define BUZ_PATTERN(name, ...)                                                \
+    constexpr AsyncBuzzer::Pulse name[] PROGMEM = {__VA_ARGS__};              \
+    static_assert(sizeof(name) / sizeof(name[0]) <= BUZZER_MAX_PATTERN_PULSES, \
+                  #name " has more than BUZZER_MAX_PATTERN_PULSES pulses")
+
+// Splits a 16-bit value into the two little-endian bytes used in packed melodies and programs
+#define BUZ_LE16(value) (uint8_t)((uint16_t)(value) & 0xFF), (uint8_t)((uint16_t)(value) >> 8)
+
+// Packed melody opcodes for packedMelody(), see "Packed Melodies" in the README:
+#define BUZ_PK_END 0x00                                  // End of the melody, added by BUZ_PACKED()
+#define BUZ_PK_KEY(name) 0x01, AsyncBuzzer::keyOf(name)  // Sets the key the next note delta starts from
+#define BUZ_PK_LOOP(passes) 0x02, AsyncBuzzer::Packed::loop(passes) // Plays up to BUZ_PK_NEXT this many times
+#define BUZ_PK_NEXT 0x03                                 // End of a loop body, loops nest two deep
+#define BUZ_PK_NOTE(delta, length) AsyncBuzzer::Packed::note(delta, length) // Note delta semitones (-8..7) from the last
+#define BUZ_PK_REST(length) AsyncBuzzer::Packed::rest(length)              // Silence for a length
+#define BUZ_PK_REPEAT(times) AsyncBuzzer::Packed::repeat(times)            // Plays the last note or rest again (1..63)
+#define BUZ_PK_LENGTHS(count) AsyncBuzzer::Packed::lengths(count)          // Length table header, up to 8 lengths
+#define BUZ_PK_LENGTH(duration, rest) BUZ_LE16(duration), BUZ_LE16(rest)
+
+// Declares a flash-resident packed melody for packedMelody_P(), play it with sizeof(name) as the size
+#define BUZ_PACKED(name, ...) \
+    constexpr uint8_t name[] PROGMEM = {__VA_ARGS__, BUZ_PK_END}
+
+// Sound program opcodes for program(), see "Sound Programs" in the README:
+#define BUZ_OP_END 0x00                                         // Stops the program, added by BUZ_PROGRAM()
+#define BUZ_OP_TONE(frequency, duration) 0x01, BUZ_LE16(frequency), BUZ_LE16(duration) // Tone plus the offset, no gap to the next op
+#define BUZ_OP_REST(duration) 0x02, BUZ_LE16(duration)          // Silence
+#define BUZ_OP_LOOP(passes) 0x03, (uint8_t)(passes)             // Runs up to BUZ_OP_NEXT this many times
+#define BUZ_OP_NEXT 0x04                                        // End of a loop body, loops nest two deep
+#define BUZ_OP_JUMP(offset) 0x05, BUZ_LE16(offset)              // Continues at a byte offset in the program, 0 restarts it
+#define BUZ_OP_SET_FREQ_OFFSET(hz) 0x06, BUZ_LE16(hz)           // Sets the offset added to TONE and RAMP frequencies
+#define BUZ_OP_ADD_FREQ_OFFSET(hz) 0x07, BUZ_LE16(hz)           // Adds to the offset, negative values lower it
+#define BUZ_OP_RAMP(frequency, duration) 0x08, BUZ_LE16(frequency), BUZ_LE16(duration) // Glides from the last frequency
+#define BUZ_OP_VOLUME(level) 0x09, (uint8_t)(level)             // setVolume() for the following tones, PWM output only
+
+// Declares a flash-resident sound program for program_P(), run it with sizeof(name) as the size
+#define BUZ_PROGRAM(name, ...) \
+    constexpr uint8_t name[] PROGMEM = {__VA_ARGS__, BUZ_OP_END}
@@ -0,0 +1,353 @@
+/*
+  AsyncBuzzer Benchmark Example
+
+  This example measures the library on the board it runs on and prints the results:
+  - Flash and RAM used by the sketch, and the RAM taken by each buzzer
+  - update() cost in CPU cycles while idle and while a pulse, pattern or melody plays
+    (in microseconds on boards without a cycle counter the sketch can read)
+  - loadTones() time for 10, 30 and 100 line files (with SD card support)
+  - Worst update() cost while a file streams or prefetches, with and without a time budget
+  - Pulse start jitter at different loop periods
+
+  Set a BENCH_ flag below to 0 and rebuild to see what that feature costs in flash and RAM.
+  The compile size report shows the difference.
+
+  Circuit:
+  - Connect a piezo buzzer between pin 2 and GND
+  - Or use any digital pin and update the pin number below
+  - Optional: SD card module with chip select on pin 10
+
+  Created by breadbaker, 2025
+  This example code is in the public domain.
+*/
+
+#include <AsyncBuzzer.h>
+
+#define BENCH_PULSE 1   // Measure update() while a pulse group plays
+#define BENCH_PATTERN 1 // Measure update() while a pattern plays
+#define BENCH_MELODY 1  // Measure update() while a melody plays
+#define BENCH_FILES 1   // Measure loadTones() with SD card support
+
+#if BENCH_FILES && defined(BUZZER_USE_SD) && __has_include(<SDCard.h>)
+#include <SDCard.h>
+#define BENCH_SD
+#endif
+
+const uint8_t BUZZER_OUTPUT_PIN = 2; // Pin connected to buzzer
+const uint8_t SD_CS_PIN = 10;        // SD card chip select
+const uint16_t CALLS = 1000;         // update() calls per cost measurement
+const uint16_t BUDGET = 100;         // update(budget) time budget in microseconds
+
+#if defined(ARDUINO_ARCH_AVR)
+extern char __data_start, __bss_end, __heap_start, __data_load_end;
+extern char *__brkval;
+#elif defined(ARDUINO_ARCH_SAMD)
+extern "C" char *sbrk(int increment);
+extern char __etext, __data_start__, __data_end__, __bss_end__;
+#endif
+
+// update() costs are read from a cycle counter: Timer1 at prescaler 1 on AVR (unless the library
+// uses it), DWT->CYCCNT on Cortex-M3 and later, SysTick on SAMD21 and the CPU cycle count on ESP32
+#if defined(ARDUINO_ARCH_AVR) && !(defined(BUZZER_USE_TIMER) && BUZZER_TIMER_AVR == 1) && \
+    !(defined(BUZZER_USE_PWM) && BUZZER_PWM_AVR == 1) && !defined(BUZZER_USE_SYNTH)
+#define BENCH_CYCLES
+volatile uint16_t cycleWraps = 0; // Timer1 overflows, the upper half of the count
+
+ISR(TIMER1_OVF_vect)
+{
+    cycleWraps++;
+}
+
+void startCycles()
+{
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10); // Normal mode at the CPU clock
+    TCNT1 = 0;
+    TIFR1 = _BV(TOV1);
+    TIMSK1 = _BV(TOIE1);
+}
+
+uint32_t cycles()
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t low = TCNT1;
+    uint16_t high = cycleWraps;
+    if ((TIFR1 & _BV(TOV1)) && low < 0x8000)
+        high++; // Wrapped while interrupts were off, the overflow is not counted yet
+    SREG = sreg;
+    return ((uint32_t)high << 16) | low;
+}
+#elif defined(DWT) && defined(CoreDebug_DEMCR_TRCENA_Msk) && defined(DWT_CTRL_CYCCNTENA_Msk)
+#define BENCH_CYCLES
+void startCycles()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t cycles()
+{
+    return DWT->CYCCNT;
+}
+#elif defined(ARDUINO_ARCH_SAMD)
+#define BENCH_CYCLES
+void startCycles() {}
+
+// SysTick counts down from LOAD to 0 once per millisecond, millis() counts the reloads
+uint32_t cycles()
+{
+    noInterrupts();
+    uint32_t ms = millis();
+    uint32_t left = SysTick->VAL;
+    if ((SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) && left > SysTick->LOAD / 2)
+        ms++; // Reloaded, but the tick interrupt has not counted it yet
+    interrupts();
+    return ms * (SysTick->LOAD + 1) + (SysTick->LOAD - left);
+}
+#elif defined(ARDUINO_ARCH_ESP32)
+#define BENCH_CYCLES
+void startCycles() {}
+
+uint32_t cycles()
+{
+    return ESP.getCycleCount();
+}
+#else
+void startCycles() {}
+
+uint32_t cycles()
+{
+    return micros();
+}
+#endif
+
+#ifdef BENCH_CYCLES
+#define BENCH_UNIT " cycles"
+#else
+#define BENCH_UNIT " us"
+#endif
+
+#if BENCH_PATTERN
+AsyncBuzzer::Pulse alarm[] = {
+    {3, 2000, BUZ_MS(40), BUZ_MS(30)},
+    {2, 1500, BUZ_MS(60), BUZ_MS(40)}};
+#endif
+#if BENCH_MELODY
+AsyncBuzzer::Tone tune[] = {
+    {440, BUZ_MS(120), BUZ_MS(30)},
+    {523, BUZ_MS(120), BUZ_MS(30)},
+    {659, BUZ_MS(120), BUZ_MS(30)},
+    {880, BUZ_MS(240), BUZ_MS(60)}};
+#endif
+
+void printFootprint()
+{
+    Serial.println("Footprint:");
+#if defined(ARDUINO_ARCH_AVR)
+    char top;
+    Serial.print("  Flash: ");
+    Serial.print((uint16_t)&__data_load_end);
+    Serial.print(" bytes  RAM: ");
+    Serial.print((uint16_t)(&__bss_end - &__data_start));
+    Serial.print(" bytes static, ");
+    Serial.print((uint16_t)(&top - (__brkval ? __brkval : &__heap_start)));
+    Serial.println(" bytes free");
+#elif defined(ARDUINO_ARCH_SAMD)
+    char top;
+    Serial.print("  Flash: ");
+    Serial.print((uint32_t)(&__etext + (&__data_end__ - &__data_start__)));
+    Serial.print(" bytes  RAM: ");
+    Serial.print((uint32_t)(&__bss_end__ - &__data_start__));
+    Serial.print(" bytes static, ");
+    Serial.print((uint32_t)(&top - sbrk(0)));
+    Serial.println(" bytes free");
+#else
+    Serial.println("  Flash and RAM usage not available on this board");
+#endif
+    Serial.print("  Each extra buzzer: ");
+    Serial.print(sizeof(AsyncBuzzer::Buzzer));
+    Serial.println(" bytes");
+}
+
+// Average and slowest update() cost over CALLS calls, in BENCH_UNIT
+void measureUpdate(const char *state, uint16_t budget = 0)
+{
+    uint32_t slowest = 0;
+    uint32_t total = 0;
+    for (uint16_t i = 0; i < CALLS; i++)
+    {
+        uint32_t start = cycles();
+        AsyncBuzzer::update(budget);
+        uint32_t elapsed = cycles() - start;
+        total += elapsed;
+        if (elapsed > slowest)
+            slowest = elapsed;
+        delayMicroseconds(200); // Let the sound move on between calls
+    }
+    Serial.print("  ");
+    Serial.print(state);
+    Serial.print(": ");
+    Serial.print(total / CALLS);
+    Serial.print(BENCH_UNIT " avg, ");
+    Serial.print(slowest);
+    Serial.println(BENCH_UNIT " max");
+}
+
+void measureCosts()
+{
+    Serial.println("update() cost:");
+    measureUpdate("idle");
+#if BENCH_PULSE
+    AsyncBuzzer::pulse(50, 2000, BUZ_MS(5), BUZ_MS(5));
+    measureUpdate("pulse");
+#endif
+#if BENCH_PATTERN
+    AsyncBuzzer::pattern(alarm, 2, true, BUZ_MS(100));
+    measureUpdate("pattern");
+    AsyncBuzzer::stopPattern();
+#endif
+#if BENCH_MELODY
+    AsyncBuzzer::melody(tune, 4, true);
+    measureUpdate("melody");
+    AsyncBuzzer::stopMelody();
+#endif
+}
+
+#ifdef BENCH_SD
+bool writeTones(const char *path, uint8_t lines)
+{
+    SD.remove(path);
+    File file = SD.open(path, FILE_WRITE);
+    if (!file)
+        return false;
+    file.println("# play");
+    for (uint8_t i = 0; i < lines; i++)
+    {
+        file.print(400 + (i * 37) % 1200);
+        file.print(", ");
+        file.print(20 + (i * 13) % 60);
+        file.print(", ");
+        file.println((i * 7) % 25);
+    }
+    file.close();
+    return true;
+}
+
+void measureFiles()
+{
+    static AsyncBuzzer::Tone tones[BUZZER_MAX_MELODY_TONES];
+    const uint8_t sizes[] = {10, 30, 100};
+    Serial.println("loadTones():");
+    if (!SD.begin(SD_CS_PIN))
+    {
+        Serial.println("  No SD card");
+        return;
+    }
+    for (uint8_t i = 0; i < sizeof(sizes); i++)
+    {
+        if (!writeTones("/bench.txt", sizes[i]))
+        {
+            Serial.println("  Cannot write /bench.txt");
+            return;
+        }
+        uint32_t start = micros();
+        uint8_t count = AsyncBuzzer::loadTones("/bench.txt", tones, BUZ_SILENT);
+        uint32_t elapsed = micros() - start;
+        Serial.print("  ");
+        Serial.print(sizes[i]);
+        Serial.print(" lines: ");
+        Serial.print(elapsed);
+        Serial.print(" us, ");
+        Serial.print(count);
+        Serial.println(count < sizes[i] ? " tones loaded (BUZZER_MAX_MELODY_TONES)" : " tones loaded");
+    }
+
+    // The 100 line file is still on the card
+    static uint8_t arena[BUZZER_MAX_MELODY_TONES * sizeof(AsyncBuzzer::Tone)];
+    AsyncBuzzer::setArena(arena, sizeof(arena));
+    Serial.println("update() cost with SD work:");
+    AsyncBuzzer::playFile("/bench.txt", BUZ_SILENT);
+    measureUpdate("stream");
+    AsyncBuzzer::playFile("/bench.txt", BUZ_SILENT);
+    measureUpdate("stream, budget", BUDGET);
+    AsyncBuzzer::stopMelody();
+    AsyncBuzzer::prefetch("/bench.txt", BUZ_SILENT);
+    measureUpdate("prefetch");
+    AsyncBuzzer::setArena(arena, sizeof(arena));
+    AsyncBuzzer::prefetch("/bench.txt", BUZ_SILENT, BUDGET);
+    measureUpdate("prefetch, budget", BUDGET);
+    AsyncBuzzer::setArena(nullptr, 0);
+    SD.remove("/bench.txt");
+}
+#endif
+
+// Plays a pulse group with update() every period microseconds and compares the pulse starts to the schedule
+void measureJitter(uint32_t period)
+{
+    const uint8_t pulses = 10;
+    const uint32_t spacing = 50000UL; // 20 ms tone and 30 ms interval
+    AsyncBuzzer::pulse(pulses, 2000, BUZ_MS(20), BUZ_MS(30));
+    uint32_t last = 0;
+    uint32_t error = 0;
+    uint8_t seen = 0;
+    uint32_t timeout = millis() + 2000;
+    while (seen < pulses && (int32_t)(millis() - timeout) < 0)
+    {
+        uint32_t called = micros();
+        if (AsyncBuzzer::update()) // True only in the call that starts a tone
+        {
+            if (seen)
+                error += called - last > spacing ? called - last - spacing : spacing - (called - last);
+            last = called;
+            seen++;
+        }
+        while (micros() - called < period)
+            ;
+    }
+    Serial.print("  ");
+    Serial.print(period);
+    Serial.print(" us loop: ");
+    if (seen < 2)
+        Serial.println("no pulse starts seen");
+    else
+    {
+        Serial.print(error / (seen - 1));
+        Serial.println(" us average jitter");
+    }
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while (!Serial && millis() < 3000)
+        ;
+
+    if (!AsyncBuzzer::setup(BUZZER_OUTPUT_PIN, BUZ_SILENT))
+    {
+        Serial.println("AsyncBuzzer initialization failed!");
+        return;
+    }
+    Serial.print("AsyncBuzzer benchmark at ");
+    Serial.print(F_CPU / 1000000UL);
+    Serial.println(" MHz");
+
+    printFootprint();
+    startCycles();
+    measureCosts();
+#ifdef BENCH_SD
+    measureFiles();
+#endif
+#ifndef BUZZER_USE_TIMER
+    Serial.println("Pulse start jitter:");
+    const uint32_t periods[] = {0, 1000, 5000, 20000};
+    for (uint8_t i = 0; i < sizeof(periods) / sizeof(periods[0]); i++)
+        measureJitter(periods[i]);
+#endif
+    Serial.println("Done.");
+}
+
+void loop()
+{
+    AsyncBuzzer::update();
+}
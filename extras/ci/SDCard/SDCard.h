@@ -0,0 +1,5 @@
+/* SDCard.h - CI stand-in for the SDCard library: AsyncBuzzer and the Benchmark example only need SD
+Copyright (c) 2025 by breadbaker
+MIT License */
+#pragma once
+#include <SD.h>
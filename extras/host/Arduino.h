@@ -0,0 +1,70 @@
+/* Arduino.h - Minimal Arduino core for building AsyncBuzzer on the host
+Copyright (c) 2025 by breadbaker
+MIT License */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#define PROGMEM
+#define F(s) ((const __FlashStringHelper *)(s))
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define memcpy_P memcpy
+
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+#define F_CPU 16000000UL
+
+class __FlashStringHelper;
+
+class String
+{
+public:
+    String(const char *s = "") : text(s) {}
+    String(const __FlashStringHelper *s) : text((const char *)s) {}
+    unsigned int length() const { return text.size(); }
+    const char *c_str() const { return text.c_str(); }
+
+private:
+    std::string text;
+};
+
+// Serial output goes to stdout and to Host::serial
+class Print
+{
+public:
+    size_t print(const char *s) { return write(s); }
+    size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+    size_t print(const String &s) { return write(s.c_str()); }
+    size_t print(char c);
+    size_t print(unsigned char v) { return print((unsigned long)v); }
+    size_t print(int v) { return print((long)v); }
+    size_t print(unsigned int v) { return print((unsigned long)v); }
+    size_t print(long v);
+    size_t print(unsigned long v);
+    size_t print(double v);
+    template <typename T>
+    size_t println(T v) { return print(v) + println(); }
+    size_t println() { return write("\n"); }
+
+private:
+    size_t write(const char *s);
+};
+extern Print Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration = 0);
+void noTone(uint8_t pin);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+void noInterrupts();
+void interrupts();
@@ -0,0 +1,27 @@
+/* Host.h - Simulated clock, tone log and Serial capture shared by the host mocks and the benchmark
+Copyright (c) 2025 by breadbaker
+MIT License */
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace Host
+{
+    // A tone() or noTone() call seen by the mocked core
+    struct ToneEvent
+    {
+        uint32_t at;        // Simulated micros() of the call
+        uint8_t pin;
+        uint16_t frequency; // 0 for noTone()
+        uint32_t duration;  // Duration passed to tone(), 0 if untimed
+    };
+
+    extern uint32_t now;                 // Simulated micros(), only moves through advance() and delay()
+    extern const char *sdRoot;           // Host directory that SD paths are resolved in
+    extern std::vector<ToneEvent> tones; // Calls since the last reset()
+    extern std::string serial;           // Serial output since the last reset()
+
+    void advance(uint32_t us);
+    void reset(uint32_t start = 1000000UL);
+}
@@ -0,0 +1,36 @@
+/* SD.h - SD card library stand-in backed by host files under Host::sdRoot
+Copyright (c) 2025 by breadbaker
+MIT License */
+#pragma once
+#include <Arduino.h>
+
+#define FILE_READ 0
+#define FILE_WRITE 1
+
+class File
+{
+public:
+    File(FILE *f = nullptr) : f(f) {}
+    operator bool() const { return f != nullptr; }
+    int available();
+    int read();
+    int read(void *buffer, size_t length) { return (int)fread(buffer, 1, length, f); }
+    size_t write(uint8_t b) { return fputc(b, f) == EOF ? 0 : 1; }
+    size_t write(const uint8_t *buffer, size_t length) { return fwrite(buffer, 1, length, f); }
+    bool seek(uint32_t pos) { return fseek(f, pos, SEEK_SET) == 0; }
+    uint32_t position() { return (uint32_t)ftell(f); }
+    uint32_t size();
+    void close();
+
+private:
+    FILE *f;
+};
+
+class SDClass
+{
+public:
+    File open(const char *path, uint8_t mode = FILE_READ);
+    bool exists(const char *path);
+    bool remove(const char *path);
+};
+extern SDClass SD;
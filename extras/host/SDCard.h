@@ -0,0 +1,5 @@
+/* SDCard.h - Host stand-in for the SDCard library, AsyncBuzzer only needs SD
+Copyright (c) 2025 by breadbaker
+MIT License */
+#pragma once
+#include <SD.h>
@@ -0,0 +1,309 @@
+/* bench.cpp - Host benchmark for AsyncBuzzer: note timing error, update() cost and file load throughput
+Copyright (c) 2025 by breadbaker
+MIT License
+
+Usage: bench [-v] [period_us ...]
+Replays update() at each call period (100, 1000, 5000 and 20000 us by default) and exits with 1 if a
+note starts early or more than three call periods late, or a chained melody more than one. */
+#include <AsyncBuzzer.h>
+#include "Host.h"
+#include <chrono>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define BENCH_PIN 5
+#define BENCH_MELODY_TONES 32
+#define BENCH_LOADS 200
+#define BENCH_COST_RUNS 5 // Runs per update() cost state, the lowest maximum is reported
+
+#ifdef BUZZER_TIMEBASE_US
+#define BENCH_UNIT_US BUZZER_TIMEBASE_US // Microseconds per Tone time unit
+#define BENCH_TICK_US 1                  // Resolution of the clock the library runs on
+#else
+#define BENCH_UNIT_US 1000
+#define BENCH_TICK_US 1000
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+// update() cost over a run, in host nanoseconds
+struct Cost
+{
+    uint32_t calls = 0;
+    double total = 0;
+    double min = 1e12;
+    double max = 0;
+
+    void add(double ns)
+    {
+        calls++;
+        total += ns;
+        if (ns < min)
+            min = ns;
+        if (ns > max)
+            max = ns;
+    }
+};
+
+static bool verbose = false;
+static bool failed = false;
+
+static void timedUpdate(Cost &cost)
+{
+    Clock::time_point begin = Clock::now();
+    AsyncBuzzer::update();
+    cost.add(std::chrono::duration<double, std::nano>(Clock::now() - begin).count());
+}
+
+// Lengths and rests vary so note boundaries do not line up with the call period
+static std::vector<AsyncBuzzer::Tone> makeMelody(uint8_t count)
+{
+    std::vector<AsyncBuzzer::Tone> tones;
+    for (uint8_t i = 0; i < count; i++)
+        tones.push_back(AsyncBuzzer::Tone(400 + (i * 37) % 1200, BUZ_MS(20 + (i * 13) % 60), BUZ_MS((i * 7) % 25)));
+    return tones;
+}
+
+// Plays the melody with update() every period microseconds and compares each note start to its schedule
+static void benchTiming(uint32_t period)
+{
+    std::vector<AsyncBuzzer::Tone> tones = makeMelody(BENCH_MELODY_TONES);
+    Host::reset();
+    AsyncBuzzer::melody(tones.data(), tones.size());
+    Cost cost;
+    for (uint32_t guard = 0; AsyncBuzzer::isMelodyActive() && guard < 10000000UL; guard++)
+    {
+        timedUpdate(cost);
+        Host::advance(period);
+    }
+
+    std::vector<uint32_t> starts;
+    for (const Host::ToneEvent &e : Host::tones)
+        if (e.frequency)
+            starts.push_back(e.at - e.at % BENCH_TICK_US); // The time the library saw
+    if (starts.size() != tones.size())
+    {
+        printf("  %6luus: %u of %u notes started\n", (unsigned long)period, (unsigned)starts.size(), (unsigned)tones.size());
+        failed = true;
+        return;
+    }
+
+    // The tone end is seen within one period, the rest end on a later call and the next note on the call after that
+    int32_t bound = 3 * period + BENCH_TICK_US;
+    int32_t worst = 0;
+    int64_t sum = 0;
+    uint32_t schedule = starts[0];
+    for (size_t i = 1; i < starts.size(); i++)
+    {
+        uint32_t length = ((uint32_t)tones[i - 1].duration + tones[i - 1].rest) * BENCH_UNIT_US;
+        int32_t error = (int32_t)(starts[i] - starts[i - 1] - length); // Against the previous note's actual start
+        schedule += length;
+        sum += error;
+        if (error > worst)
+            worst = error;
+        if (error < 0 || error > bound)
+            failed = true;
+        if (verbose)
+            printf("    note %2u: %5luus late, %6ldus behind the score\n", (unsigned)i, (long)error, (long)(int32_t)(starts[i] - schedule));
+    }
+    printf("  %6luus: notes %u  error avg %ld max %ldus%s  drift %ldus  update() %u calls, avg %.0f max %.0fns\n", (unsigned long)period, (unsigned)starts.size(),
+           (long)(sum / (int64_t)(starts.size() - 1)), (long)worst, worst > bound ? " (over bound)" : "", (long)(int32_t)(starts.back() - schedule), cost.calls,
+           cost.total / cost.calls, cost.max);
+}
+
+// Chains a second melody behind the first and measures how late its first note starts after the first one's last rest
+static void benchChain(uint32_t period)
+{
+    std::vector<AsyncBuzzer::Tone> first = makeMelody(8);
+    std::vector<AsyncBuzzer::Tone> second = makeMelody(4);
+    Host::reset();
+    AsyncBuzzer::melody(first.data(), first.size());
+    AsyncBuzzer::chain(AsyncBuzzer::Sound(BUZ_SOUND_MELODY, 0, BUZ_NONE, second.data(), second.size()));
+    for (uint32_t guard = 0; AsyncBuzzer::isMelodyActive() && guard < 10000000UL; guard++)
+    {
+        AsyncBuzzer::update();
+        Host::advance(period);
+    }
+
+    std::vector<uint32_t> starts;
+    for (const Host::ToneEvent &e : Host::tones)
+        if (e.frequency)
+            starts.push_back(e.at - e.at % BENCH_TICK_US);
+    if (starts.size() != first.size() + second.size())
+    {
+        printf("  %6luus: %u of %u notes started\n", (unsigned long)period, (unsigned)starts.size(), (unsigned)(first.size() + second.size()));
+        failed = true;
+        return;
+    }
+    const AsyncBuzzer::Tone &last = first.back();
+    uint32_t end = starts[first.size() - 1] + ((uint32_t)last.duration + last.rest) * BENCH_UNIT_US;
+    int32_t gap = (int32_t)(starts[first.size()] - end);
+    int32_t bound = period + BENCH_TICK_US; // The end is seen on the next call and the chained note starts in it
+    if (gap < 0 || gap > bound)
+        failed = true;
+    printf("  %6luus: gap %ldus%s\n", (unsigned long)period, (long)gap, gap > bound ? " (over bound)" : "");
+}
+
+static AsyncBuzzer::Pulse alarm[] = {AsyncBuzzer::Pulse(3, 2000, BUZ_MS(40), BUZ_MS(30)), AsyncBuzzer::Pulse(2, 1500, BUZ_MS(60), BUZ_MS(40))};
+static std::vector<AsyncBuzzer::Tone> costMelody = makeMelody(BENCH_MELODY_TONES);
+
+static void startIdle() {}
+static void startPulse() { AsyncBuzzer::pulse(5, 1000, BUZ_MS(30), BUZ_MS(30)); }
+static void startPattern() { AsyncBuzzer::pattern(alarm, 2, true, BUZ_MS(100)); }
+static void startMelody() { AsyncBuzzer::melody(costMelody.data(), costMelody.size(), true); }
+static const uint8_t costProgram[] = {BUZ_OP_LOOP(4), BUZ_OP_TONE(800, BUZ_MS(20)), BUZ_OP_ADD_FREQ_OFFSET(100), BUZ_OP_NEXT,
+                                      BUZ_OP_RAMP(400, BUZ_MS(50)), BUZ_OP_SET_FREQ_OFFSET(0), BUZ_OP_REST(BUZ_MS(10)), BUZ_OP_END};
+static void startProgram() { AsyncBuzzer::program(costProgram, sizeof(costProgram)); }
+static void startSweep() { AsyncBuzzer::sweep(400, 2400, BUZ_MS(500), BUZ_CURVE_EXP | BUZ_CURVE_BOUNCE, true); }
+#ifdef BUZZER_USE_SD
+static uint8_t sounds[512];
+static void startStream() { AsyncBuzzer::playFile("/tones.txt", BUZ_SILENT); }
+static void startPrefetch()
+{
+    AsyncBuzzer::setArena(sounds, sizeof(sounds));
+    AsyncBuzzer::prefetch("/tones.txt", BUZ_SILENT, 0); // One line per call, the simulated clock does not move inside update()
+}
+#endif
+
+// update() cost in one playing state, at a 1 ms loop period. Host preemption only adds time,
+// so the lowest maximum of several runs is the worst case of the library itself
+static void benchCost(const char *name, void (*start)())
+{
+    Cost cost;
+    double max = 1e12;
+    for (uint8_t run = 0; run < BENCH_COST_RUNS; run++)
+    {
+        Host::reset();
+        AsyncBuzzer::stopPattern();
+        AsyncBuzzer::stopMelody();
+        AsyncBuzzer::stopProgram();
+        AsyncBuzzer::stopSweep();
+        Host::tones.reserve(65536); // A growing tone log would show up as update() cost
+        start();
+        Cost runCost;
+        for (uint32_t i = 0; i < 20000; i++)
+        {
+            timedUpdate(runCost);
+            Host::advance(1000);
+            uint32_t deadline;
+            if (!AsyncBuzzer::nextDeadline(deadline) && !AsyncBuzzer::isPrefetching())
+                start(); // Keeps a finished sound playing
+        }
+        cost.calls += runCost.calls;
+        cost.total += runCost.total;
+        if (runCost.min < cost.min)
+            cost.min = runCost.min;
+        if (runCost.max < max)
+            max = runCost.max;
+    }
+    printf("  %-8s min %6.0f avg %6.0f max %6.0fns\n", name, cost.min, cost.total / cost.calls, max);
+}
+
+#ifdef BUZZER_USE_SD
+static bool writeFile(const char *name, const char *prologue, uint8_t lines, uint8_t fields)
+{
+    std::string path = std::string(Host::sdRoot) + "/" + name;
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f)
+        return false;
+    fprintf(f, "%s\n# Synthetic benchmark file\n\n", prologue);
+    for (uint8_t i = 0; i < lines; i++)
+    {
+        if (fields == 3)
+            fprintf(f, "%u, %u, %u\n", 400 + (i * 37) % 1200, 20 + (i * 13) % 60, (i * 7) % 25);
+        else
+            fprintf(f, "%u, %u, %u, %u\n", 1 + i % 4, 1000 + (i * 37) % 1200, 20 + (i * 13) % 60, 30);
+        if (i % 8 == 7)
+            fprintf(f, "# Section %u\n", i / 8);
+    }
+    fclose(f);
+    return true;
+}
+#endif
+
+// Loads a synthetic file repeatedly and reports the parse rate
+template <typename T>
+static void benchLoad(const char *label, const char *name, uint8_t lines, uint8_t (*load)(const String &, T *, uint8_t))
+{
+    std::string path = std::string("/") + name;
+    std::string host = std::string(Host::sdRoot) + path;
+    struct stat info;
+    stat(host.c_str(), &info);
+    std::vector<T> items(lines);
+    uint8_t count = 0;
+    Clock::time_point begin = Clock::now();
+    for (uint16_t i = 0; i < BENCH_LOADS; i++)
+        count = load(String(path.c_str()), items.data(), BUZ_SILENT);
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    if (count != lines)
+    {
+        printf("  %-8s loaded %u of %u lines\n", label, count, lines);
+        failed = true;
+        return;
+    }
+    printf("  %-8s %3u lines  %7.2fus per load  %9.0f lines/s  %7.1f KB/s\n", label, lines, seconds * 1e6 / BENCH_LOADS, lines * BENCH_LOADS / seconds,
+           info.st_size * BENCH_LOADS / seconds / 1024);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint32_t> periods;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-v"))
+            verbose = true;
+        else
+            periods.push_back(strtoul(argv[i], nullptr, 10));
+    }
+    if (periods.empty())
+        periods = {100, 1000, 5000, 20000};
+
+    AsyncBuzzer::setup(BENCH_PIN, BUZ_SILENT);
+
+    printf("Note timing (%u-note melody, error per note against the previous note start):\n", BENCH_MELODY_TONES);
+    for (uint32_t period : periods)
+        benchTiming(period);
+
+    printf("Chained melody (first note against the end of the melody before it):\n");
+    for (uint32_t period : periods)
+        benchChain(period);
+
+#ifdef BUZZER_USE_SD
+    mkdir(Host::sdRoot, 0755);
+    if (!writeFile("tones.txt", "# play", BUZZER_MAX_MELODY_TONES, 3) || !writeFile("pattern.txt", "# pattern", BUZZER_MAX_PATTERN_PULSES, 4))
+    {
+        printf("  Cannot write to %s\n", Host::sdRoot);
+        return 1;
+    }
+#endif
+
+    printf("update() cost at a 1 ms loop period (lowest maximum of %u runs):\n", BENCH_COST_RUNS);
+    benchCost("idle", startIdle);
+    benchCost("pulse", startPulse);
+    benchCost("pattern", startPattern);
+    benchCost("melody", startMelody);
+    benchCost("program", startProgram);
+    benchCost("sweep", startSweep);
+#ifdef BUZZER_USE_SD
+    benchCost("stream", startStream);
+    benchCost("prefetch", startPrefetch);
+#endif
+    AsyncBuzzer::stopPattern();
+    AsyncBuzzer::stopMelody();
+    AsyncBuzzer::stopProgram();
+    AsyncBuzzer::stopSweep();
+
+#ifdef BUZZER_USE_SD
+    printf("File loading (%u loads each):\n", BENCH_LOADS);
+    benchLoad<AsyncBuzzer::Tone>("tones", "tones.txt", BUZZER_MAX_MELODY_TONES, AsyncBuzzer::loadTones);
+    benchLoad<AsyncBuzzer::Pulse>("pattern", "pattern.txt", BUZZER_MAX_PATTERN_PULSES, AsyncBuzzer::loadPattern);
+    static uint8_t cache[512];
+    AsyncBuzzer::setCache(cache, sizeof(cache));
+    benchLoad<AsyncBuzzer::Tone>("cached", "tones.txt", BUZZER_MAX_MELODY_TONES, AsyncBuzzer::loadTones); // Served from the cache after the first load
+    AsyncBuzzer::setCache(nullptr, 0);
+#endif
+
+    if (failed)
+        printf("FAILED\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,147 @@
+/* host.cpp - Arduino core and SD stand-ins for the host build
+Copyright (c) 2025 by breadbaker
+MIT License */
+#include <Arduino.h>
+#include <SD.h>
+#include "Host.h"
+
+namespace Host
+{
+    uint32_t now = 1000000UL;
+    const char *sdRoot = "sd";
+    std::vector<ToneEvent> tones;
+    std::string serial;
+
+    void advance(uint32_t us)
+    {
+        now += us;
+    }
+
+    void reset(uint32_t start)
+    {
+        now = start;
+        tones.clear();
+        serial.clear();
+    }
+
+    static std::string sdPath(const char *path)
+    {
+        return std::string(sdRoot) + (path[0] == '/' ? "" : "/") + path;
+    }
+}
+
+Print Serial;
+SDClass SD;
+
+size_t Print::write(const char *s)
+{
+    Host::serial += s;
+    return fputs(s, stdout) < 0 ? 0 : strlen(s);
+}
+
+size_t Print::print(char c)
+{
+    char s[2] = {c, '\0'};
+    return write(s);
+}
+
+size_t Print::print(long v)
+{
+    char s[24];
+    snprintf(s, sizeof(s), "%ld", v);
+    return write(s);
+}
+
+size_t Print::print(unsigned long v)
+{
+    char s[24];
+    snprintf(s, sizeof(s), "%lu", v);
+    return write(s);
+}
+
+size_t Print::print(double v)
+{
+    char s[32];
+    snprintf(s, sizeof(s), "%.2f", v);
+    return write(s);
+}
+
+unsigned long millis()
+{
+    return Host::now / 1000;
+}
+
+unsigned long micros()
+{
+    return Host::now;
+}
+
+void delay(unsigned long ms)
+{
+    Host::now += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    Host::now += us;
+}
+
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration)
+{
+    Host::tones.push_back(Host::ToneEvent{Host::now, pin, (uint16_t)frequency, (uint32_t)duration});
+}
+
+void noTone(uint8_t pin)
+{
+    Host::tones.push_back(Host::ToneEvent{Host::now, pin, 0, 0});
+}
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+void noInterrupts() {}
+void interrupts() {}
+
+int File::available()
+{
+    long pos = ftell(f);
+    return (int)(size() - pos);
+}
+
+int File::read()
+{
+    return fgetc(f);
+}
+
+uint32_t File::size()
+{
+    long pos = ftell(f);
+    fseek(f, 0, SEEK_END);
+    long end = ftell(f);
+    fseek(f, pos, SEEK_SET);
+    return (uint32_t)end;
+}
+
+void File::close()
+{
+    if (f)
+        fclose(f);
+    f = nullptr;
+}
+
+File SDClass::open(const char *path, uint8_t mode)
+{
+    return File(fopen(Host::sdPath(path).c_str(), mode == FILE_READ ? "rb" : "wb+"));
+}
+
+bool SDClass::exists(const char *path)
+{
+    FILE *f = fopen(Host::sdPath(path).c_str(), "rb");
+    if (f)
+        fclose(f);
+    return f != nullptr;
+}
+
+bool SDClass::remove(const char *path)
+{
+    return ::remove(Host::sdPath(path).c_str()) == 0;
+}
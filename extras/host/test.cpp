@@ -0,0 +1,457 @@
+/* test.cpp - Host tests for the AsyncBuzzer file formats, decoders and memory managers
+Copyright (c) 2025 by breadbaker
+MIT License
+
+Build and run with "make test", add DEFINES=-DBUZZER_USE_TONE_TABLE or
+DEFINES=-DBUZZER_TIMEBASE_US=100 to test those builds. Exits with 1 if a check fails. */
+#include <AsyncBuzzer.h>
+#include "Host.h"
+#include <sys/stat.h>
+
+#define TEST_PIN 5
+
+static bool failed = false;
+static const char *current = "";
+
+#define CHECK(condition)                                                                \
+    do                                                                                  \
+    {                                                                                   \
+        if (!(condition))                                                               \
+        {                                                                               \
+            printf("  %s: line %d: %s\n", current, __LINE__, #condition);               \
+            failed = true;                                                              \
+        }                                                                               \
+    } while (0)
+
+// Frequencies passed to tone() since the last reset(), noTone() calls left out
+static std::vector<uint16_t> played()
+{
+    std::vector<uint16_t> frequencies;
+    for (const Host::ToneEvent &e : Host::tones)
+        if (e.frequency)
+            frequencies.push_back(e.frequency);
+    return frequencies;
+}
+
+// Start times of the tones since the last reset(), in microseconds after the first one
+static std::vector<uint32_t> starts()
+{
+    std::vector<uint32_t> times;
+    uint32_t first = 0;
+    for (const Host::ToneEvent &e : Host::tones)
+        if (e.frequency)
+        {
+            if (times.empty())
+                first = e.at;
+            times.push_back(e.at - first);
+        }
+    return times;
+}
+
+// Runs update() every 100 us until nothing is left to play, at most limit microseconds
+static void runUntilIdle(uint32_t limit = 10000000UL)
+{
+    for (uint32_t t = 0; t < limit; t += 100)
+    {
+        AsyncBuzzer::update();
+        uint32_t deadline;
+        if (!AsyncBuzzer::nextDeadline(deadline) && !AsyncBuzzer::isPrefetching())
+            return;
+        Host::advance(100);
+    }
+}
+
+static void begin(const char *name)
+{
+    current = name;
+    AsyncBuzzer::stopPattern();
+    AsyncBuzzer::stopMelody();
+    AsyncBuzzer::stopProgram();
+    AsyncBuzzer::stopSweep();
+    AsyncBuzzer::update();
+    Host::reset();
+}
+
+static bool near(uint32_t value, uint32_t expected, uint32_t tolerance)
+{
+    return value + tolerance >= expected && value <= expected + tolerance;
+}
+
+// Note lengths in BUZ_MS() units: 100 ms on, 10 ms off and 200 ms on, no gap
+BUZ_PACKED(packed,
+           BUZ_PK_LENGTHS(2), BUZ_PK_LENGTH(BUZ_MS(100), BUZ_MS(10)), BUZ_PK_LENGTH(BUZ_MS(200), 0),
+           BUZ_PK_KEY("C5"), BUZ_PK_NOTE(0, 0), BUZ_PK_NOTE(2, 0), BUZ_PK_NOTE(2, 1), BUZ_PK_REST(0),
+           BUZ_PK_LOOP(2), BUZ_PK_NOTE(1, 0), BUZ_PK_NOTE(-1, 0), BUZ_PK_NEXT,
+           BUZ_PK_REPEAT(2));
+
+static void testPacked()
+{
+    begin("packed melody");
+    AsyncBuzzer::packedMelody_P(packed, sizeof(packed));
+    runUntilIdle();
+    const uint16_t c5 = AsyncBuzzer::note("C5"), d5 = AsyncBuzzer::note("D5"), e5 = AsyncBuzzer::note("E5"), f5 = AsyncBuzzer::note("F5");
+    std::vector<uint16_t> expected = {c5, d5, e5, f5, e5, f5, e5, e5, e5};
+    CHECK(played() == expected);
+    std::vector<uint32_t> at = starts();
+    if (at.size() == expected.size())
+    {
+        CHECK(near(at[1], 110000, 1000));              // C5 plus its rest
+        CHECK(near(at[2] - at[1], 110000, 1000));      // D5 plus its rest
+        CHECK(near(at[3] - at[2], 200000 + 110000, 1000)); // E5 with no rest, then the rest of length 0
+        CHECK(near(at[8] - at[7], 110000, 1000));      // A repeat of E5
+    }
+    CHECK(!AsyncBuzzer::isMelodyActive());
+}
+
+// LOOP runs the body three times, JUMP skips the 3000 Hz tone
+static const uint8_t programCode[] = {
+    BUZ_OP_LOOP(3),                      // 0
+    BUZ_OP_TONE(1000, BUZ_MS(50)),       // 2
+    BUZ_OP_REST(BUZ_MS(20)),             // 7
+    BUZ_OP_ADD_FREQ_OFFSET(100),         // 10
+    BUZ_OP_NEXT,                         // 13
+    BUZ_OP_JUMP(22),                     // 14
+    BUZ_OP_TONE(3000, BUZ_MS(50)),       // 17
+    BUZ_OP_SET_FREQ_OFFSET(0),           // 22
+    BUZ_OP_TONE(500, BUZ_MS(50)),        // 25
+    BUZ_OP_END};                         // 30
+
+static void testProgram()
+{
+    begin("program");
+    AsyncBuzzer::program(programCode, sizeof(programCode));
+    runUntilIdle();
+    std::vector<uint16_t> expected = {1000, 1100, 1200, 500};
+    CHECK(played() == expected);
+    std::vector<uint32_t> at = starts();
+    if (at.size() == expected.size())
+    {
+        CHECK(near(at[1], 70000, 1000));
+        CHECK(near(at[3] - at[2], 70000, 1000));
+    }
+    CHECK(!AsyncBuzzer::isProgramActive());
+}
+
+// Multi-second ramps both ways, long enough to overflow 32 bits in microseconds if multiplied directly
+static const uint8_t rampCode[] = {
+    BUZ_OP_TONE(400, BUZ_MS(10)),
+    BUZ_OP_RAMP(2400, BUZ_MS(3000)),
+    BUZ_OP_RAMP(400, BUZ_MS(3000)),
+    BUZ_OP_END};
+
+static void testRamp()
+{
+    begin("ramp");
+    AsyncBuzzer::program(rampCode, sizeof(rampCode));
+    runUntilIdle();
+    std::vector<uint16_t> frequencies = played();
+    CHECK(frequencies.size() > 100);
+    bool falling = false;
+    for (size_t i = 1; i < frequencies.size(); i++)
+    {
+        CHECK(frequencies[i] >= 400 && frequencies[i] <= 2400);
+        if (frequencies[i] < frequencies[i - 1])
+            falling = true;
+        else if (falling)
+            CHECK(frequencies[i] == frequencies[i - 1]); // One turn, at the top
+    }
+    for (const Host::ToneEvent &e : Host::tones)
+    {
+        uint32_t t = e.at - Host::tones.front().at;
+        if (e.frequency && t > 10000 && t < 3010000)
+            CHECK(near(e.frequency, 400 + (uint64_t)(t - 10000) * 2000 / 3000000, 20));
+    }
+    CHECK(!AsyncBuzzer::isProgramActive());
+}
+
+// Both curves start on the first frequency and end on the second, in either direction
+static void testSweep(uint16_t from, uint16_t to, uint8_t curve)
+{
+    begin("sweep");
+    AsyncBuzzer::sweep(from, to, BUZ_MS(300), curve);
+    runUntilIdle();
+    std::vector<uint16_t> frequencies = played();
+    CHECK(frequencies.size() > 2);
+    if (frequencies.empty())
+        return;
+    CHECK(frequencies.front() == from);
+    CHECK(frequencies.back() == to);
+    for (size_t i = 1; i < frequencies.size(); i++)
+        CHECK(from < to ? frequencies[i] >= frequencies[i - 1] : frequencies[i] <= frequencies[i - 1]);
+    CHECK(near(Host::tones.back().at - Host::tones.front().at, 300000, 1000));
+    CHECK(!AsyncBuzzer::isSweepActive());
+}
+
+// A late update() lands on the step for the time since the start, even several passes on
+static void testSweepStall()
+{
+    begin("sweep stall");
+    AsyncBuzzer::sweep(400, 2400, BUZ_MS(200), BUZ_CURVE_LINEAR | BUZ_CURVE_BOUNCE, true);
+    AsyncBuzzer::update();
+    Host::advance(1050000); // 5 passes of 200 ms, then a quarter of the way into the next one
+    AsyncBuzzer::update();
+    std::vector<uint16_t> frequencies = played();
+    CHECK(frequencies.size() == 2);
+    CHECK(!frequencies.empty() && frequencies.back() == 1400);
+    CHECK(AsyncBuzzer::isSweepActive());
+    AsyncBuzzer::sweep(400, 2400, BUZ_MS(200), BUZ_CURVE_LINEAR);
+    AsyncBuzzer::update();
+    Host::advance(250000);
+    AsyncBuzzer::update();
+    CHECK(!AsyncBuzzer::isSweepActive());
+}
+
+#ifdef BUZZER_USE_SD
+static void writeFile(const char *name, const char *text)
+{
+    std::string path = std::string(Host::sdRoot) + "/" + name;
+    FILE *f = fopen(path.c_str(), "w");
+    if (f)
+    {
+        fputs(text, f);
+        fclose(f);
+    }
+}
+
+static bool sameTones(const AsyncBuzzer::Tone *a, const AsyncBuzzer::Tone *b, uint8_t count)
+{
+    for (uint8_t i = 0; i < count; i++)
+        if (a[i].frequency != b[i].frequency || a[i].duration != b[i].duration || a[i].rest != b[i].rest)
+            return false;
+    return true;
+}
+
+static bool samePulses(const AsyncBuzzer::Pulse *a, const AsyncBuzzer::Pulse *b, uint8_t count)
+{
+    for (uint8_t i = 0; i < count; i++)
+        if (a[i].pulses != b[i].pulses || a[i].frequency != b[i].frequency || a[i].duration != b[i].duration || a[i].interval != b[i].interval)
+            return false;
+    return true;
+}
+
+// A converted file loads to the same records as its text source
+static void testBinary()
+{
+    begin("binary round trip");
+    writeFile("melody.txt", "# play\n440, 100, 20\n880, 150, 0 # comment\n\n1320, 65535, 5\n");
+    writeFile("alarm.txt", "# pattern\n3, 2000, 40, 30\n255, 1500, 60, 40\n");
+    CHECK(AsyncBuzzer::convertFile("/melody.txt", "/melody.bin", BUZ_SILENT) == 3);
+    CHECK(AsyncBuzzer::convertFile("/alarm.txt", "/alarm.bin", BUZ_SILENT) == 2);
+    AsyncBuzzer::Tone text[4], binary[4];
+    CHECK(AsyncBuzzer::loadTones("/melody.txt", text, BUZ_SILENT) == 3);
+    CHECK(AsyncBuzzer::loadTones("/melody.bin", binary, BUZ_SILENT) == 3);
+    CHECK(sameTones(text, binary, 3));
+    CHECK(text[2].frequency == 1320 && text[1].rest == 0);
+    AsyncBuzzer::Pulse textPulses[4], binaryPulses[4];
+    CHECK(AsyncBuzzer::loadPattern("/alarm.txt", textPulses, BUZ_SILENT) == 2);
+    CHECK(AsyncBuzzer::loadPattern("/alarm.bin", binaryPulses, BUZ_SILENT) == 2);
+    CHECK(samePulses(textPulses, binaryPulses, 2));
+    CHECK(binaryPulses[1].pulses == 255);
+    CHECK(AsyncBuzzer::loadTones("/alarm.bin", binary, BUZ_SILENT) == 0); // Pulses are not tones
+}
+
+// Skipped lines are reported by number, with the ANSI colors taken out
+static void testParserErrors()
+{
+    begin("parser errors");
+    writeFile("errors.txt", "# play\n440, 100, 20\nabc, 100, 20\n440, 100\n440, 100, 20, 5\n65536, 100, 20\n880, 100, 20\n");
+    AsyncBuzzer::Tone tones[8];
+    CHECK(AsyncBuzzer::loadTones("/errors.txt", tones, BUZ_NONE) == 2);
+    CHECK(tones[0].frequency == 440 && tones[1].frequency == 880);
+    std::string log;
+    for (size_t i = 0; i < Host::serial.size(); i++)
+    {
+        if (Host::serial[i] == '\033')
+            while (i < Host::serial.size() && Host::serial[i] != 'm')
+                i++;
+        else
+            log += Host::serial[i];
+    }
+    for (int line = 3; line <= 6; line++)
+        CHECK(log.find("Skipped malformed line " + std::to_string(line) + "\n") != std::string::npos);
+    CHECK(log.find("Skipped malformed line 2\n") == std::string::npos);
+    CHECK(log.find("Skipped malformed line 7\n") == std::string::npos);
+}
+
+// A cached file is served without rereading it until uncache() drops it
+static void testCache()
+{
+    begin("cache");
+    static uint8_t buffer[256];
+    AsyncBuzzer::setCache(buffer, sizeof(buffer));
+    writeFile("cached.txt", "# play\n500, 10, 0\n600, 10, 0\n");
+    AsyncBuzzer::Tone tones[4];
+    CHECK(AsyncBuzzer::loadTones("/cached.txt", tones, BUZ_SILENT) == 2);
+    writeFile("cached.txt", "# play\n700, 10, 0\n800, 10, 0\n900, 10, 0\n");
+    CHECK(AsyncBuzzer::loadTones("/cached.txt", tones, BUZ_SILENT) == 2); // Hit
+    CHECK(tones[0].frequency == 500);
+    AsyncBuzzer::uncache("/cached.txt");
+    CHECK(AsyncBuzzer::loadTones("/cached.txt", tones, BUZ_SILENT) == 3);
+    CHECK(tones[0].frequency == 700);
+    writeFile("cached.txt", "# play\n1000, 10, 0\n");
+    AsyncBuzzer::clearCache();
+    CHECK(AsyncBuzzer::loadTones("/cached.txt", tones, BUZ_SILENT) == 1);
+    CHECK(tones[0].frequency == 1000);
+    AsyncBuzzer::setCache(nullptr, 0);
+}
+
+// A freed slot is reused under a new generation, the old handle stays invalid
+static void testArena()
+{
+    begin("arena");
+    static uint8_t buffer[128];
+    AsyncBuzzer::setArena(buffer, sizeof(buffer));
+    writeFile("a.txt", "# play\n500, 10, 0\n600, 10, 0\n");
+    writeFile("b.txt", "# play\n700, 10, 0\n800, 10, 0\n900, 10, 0\n");
+    AsyncBuzzer::SoundHandle a = AsyncBuzzer::loadSound("/a.txt", BUZ_SILENT);
+    CHECK(a != BUZ_NO_SOUND);
+    CHECK(AsyncBuzzer::soundLength(a) == 2);
+    CHECK(AsyncBuzzer::releaseSound(a));
+    CHECK(!AsyncBuzzer::releaseSound(a));
+    AsyncBuzzer::SoundHandle b = AsyncBuzzer::loadSound("/b.txt", BUZ_SILENT);
+    CHECK(b != BUZ_NO_SOUND && b != a);
+    CHECK((b & 0xFF) == (a & 0xFF));
+    CHECK(AsyncBuzzer::soundLength(a) == 0);
+    CHECK(AsyncBuzzer::soundLength(b) == 3);
+    CHECK(!AsyncBuzzer::playSound(a));
+    CHECK(AsyncBuzzer::playSound(b));
+    AsyncBuzzer::update();
+    CHECK(!AsyncBuzzer::releaseSound(b)); // Still playing
+    runUntilIdle();
+    std::vector<uint16_t> expected = {700, 800, 900};
+    CHECK(played() == expected);
+    CHECK(AsyncBuzzer::releaseSound(b));
+    AsyncBuzzer::setArena(nullptr, 0);
+}
+
+// Replacing the arena stops what plays from it and drops what is queued or chained from it
+static void testArenaSwitch()
+{
+    begin("arena switch");
+    static uint8_t first[128], second[128];
+    AsyncBuzzer::setArena(first, sizeof(first));
+    AsyncBuzzer::SoundHandle a = AsyncBuzzer::loadSound("/a.txt", BUZ_SILENT);
+    AsyncBuzzer::SoundHandle b = AsyncBuzzer::loadSound("/b.txt", BUZ_SILENT);
+    CHECK(AsyncBuzzer::playSound(b));
+    AsyncBuzzer::update();
+    CHECK(AsyncBuzzer::chain(AsyncBuzzer::loadedSound(a)));
+    CHECK(AsyncBuzzer::post(AsyncBuzzer::loadedSound(a)));
+    CHECK(AsyncBuzzer::queuedSounds() == 1);
+    AsyncBuzzer::setArena(second, sizeof(second));
+    CHECK(!AsyncBuzzer::isMelodyActive());
+    CHECK(!AsyncBuzzer::isChained());
+    CHECK(AsyncBuzzer::queuedSounds() == 0);
+    memset(first, 0xFF, sizeof(first)); // The old arena is free for the sketch to reuse
+    Host::reset();
+    runUntilIdle();
+    CHECK(played().empty());
+    AsyncBuzzer::SoundHandle again = AsyncBuzzer::loadSound("/b.txt", BUZ_SILENT); // Starts a fresh tone table too
+    CHECK(AsyncBuzzer::playSound(again));
+    runUntilIdle();
+    std::vector<uint16_t> expected = {700, 800, 900};
+    CHECK(played() == expected);
+    AsyncBuzzer::setArena(nullptr, 0);
+}
+
+// A prefetched sound has no records until update() has decoded the whole file
+static void testPrefetch()
+{
+    begin("prefetch");
+    static uint8_t buffer[256];
+    AsyncBuzzer::setArena(buffer, sizeof(buffer));
+    std::string text = "# play\n";
+    for (int i = 0; i < 20; i++)
+        text += std::to_string(400 + (i % 10) * 50) + ", 10, 0\n"; // Fits the smallest tone table
+    writeFile("long.txt", text.c_str());
+    AsyncBuzzer::SoundHandle h = AsyncBuzzer::prefetch("/long.txt", BUZ_SILENT, 1);
+    CHECK(h != BUZ_NO_SOUND);
+    CHECK(AsyncBuzzer::isPrefetching());
+    CHECK(AsyncBuzzer::soundLength(h) == 0);
+    CHECK(!AsyncBuzzer::playSound(h));
+    CHECK(AsyncBuzzer::prefetch("/long.txt", BUZ_SILENT) == BUZ_NO_SOUND); // One at a time
+    runUntilIdle();
+    CHECK(!AsyncBuzzer::isPrefetching());
+    CHECK(AsyncBuzzer::soundLength(h) == 20);
+    Host::reset();
+    CHECK(AsyncBuzzer::playSound(h));
+    runUntilIdle();
+    std::vector<uint16_t> frequencies = played();
+    CHECK(frequencies.size() == 20);
+    CHECK(!frequencies.empty() && frequencies.front() == 400 && frequencies.back() == 850);
+    CHECK(AsyncBuzzer::releaseSound(h));
+    CHECK(AsyncBuzzer::prefetch("/missing.txt", BUZ_SILENT) == BUZ_NO_SOUND);
+    CHECK(!AsyncBuzzer::isPrefetching());
+    AsyncBuzzer::setArena(nullptr, 0);
+}
+
+#ifdef BUZZER_USE_TONE_TABLE
+static void writeTones(const char *name, uint16_t first, uint8_t distinct, uint8_t count)
+{
+    std::string text = "# play\n";
+    for (uint8_t i = 0; i < count; i++)
+        text += std::to_string(first + (i % distinct) * 10) + ", " + std::to_string(10 + i % 2) + ", 0\n";
+    writeFile(name, text.c_str());
+}
+
+// Repeated values share an entry, released sounds give theirs back
+static void testToneTable()
+{
+    begin("tone table");
+    static uint8_t buffer[512];
+    AsyncBuzzer::setArena(buffer, sizeof(buffer));
+    writeTones("few.txt", 1000, 5, 30);                           // 30 records over 5 frequencies
+    writeTones("many.txt", 2000, BUZZER_TABLE_FREQUENCIES - 4, 20); // Fits only once the 5 are freed
+    AsyncBuzzer::SoundHandle few = AsyncBuzzer::loadSound("/few.txt", BUZ_SILENT);
+    CHECK(few != BUZ_NO_SOUND);
+    AsyncBuzzer::SoundHandle twice = AsyncBuzzer::loadSound("/few.txt", BUZ_SILENT); // Shares the same 5
+    CHECK(twice != BUZ_NO_SOUND);
+    CHECK(AsyncBuzzer::loadSound("/many.txt", BUZ_SILENT) == BUZ_NO_SOUND);
+    CHECK(AsyncBuzzer::playSound(few));
+    runUntilIdle();
+    std::vector<uint16_t> frequencies = played();
+    CHECK(frequencies.size() == 30);
+    for (size_t i = 0; i < frequencies.size(); i++)
+        CHECK(frequencies[i] == 1000 + (i % 5) * 10);
+    CHECK(AsyncBuzzer::releaseSound(few));
+    CHECK(AsyncBuzzer::loadSound("/many.txt", BUZ_SILENT) == BUZ_NO_SOUND); // Still held by twice
+    CHECK(AsyncBuzzer::releaseSound(twice));
+    for (int cycle = 0; cycle < 20; cycle++)
+    {
+        AsyncBuzzer::SoundHandle many = AsyncBuzzer::loadSound("/many.txt", BUZ_SILENT);
+        CHECK(many != BUZ_NO_SOUND);
+        CHECK(AsyncBuzzer::releaseSound(many));
+        few = AsyncBuzzer::loadSound("/few.txt", BUZ_SILENT);
+        CHECK(few != BUZ_NO_SOUND);
+        CHECK(AsyncBuzzer::releaseSound(few));
+    }
+    AsyncBuzzer::setArena(nullptr, 0);
+}
+#endif
+#endif
+
+int main()
+{
+    AsyncBuzzer::setup(TEST_PIN, BUZ_SILENT);
+    testPacked();
+    testProgram();
+    testRamp();
+    testSweep(400, 2400, BUZ_CURVE_LINEAR);
+    testSweep(2400, 400, BUZ_CURVE_LINEAR);
+    testSweep(400, 2400, BUZ_CURVE_EXP);
+    testSweep(2400, 400, BUZ_CURVE_EXP);
+    testSweepStall();
+#ifdef BUZZER_USE_SD
+    mkdir(Host::sdRoot, 0755);
+    testBinary();
+    testParserErrors();
+    testCache();
+    testArena();
+    testArenaSwitch();
+    testPrefetch();
+#ifdef BUZZER_USE_TONE_TABLE
+    testToneTable();
+#endif
+#endif
+    printf(failed ? "FAILED\n" : "All tests passed\n");
+    return failed ? 1 : 0;
+}